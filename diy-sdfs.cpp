@@ -8,7 +8,7 @@
 #define _XOPEN_SOURCE 700
 #endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -20,22 +20,33 @@
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 
 #include <limits.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <libgen.h>
+#include <ctype.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <fstream>
 #include <algorithm>
 #include <fnmatch.h>
+#include <glob.h>
 #include <cstddef>
 #include <pthread.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <chrono>
 #include <sstream>
+#include <memory>
+#include <deque>
+#include <list>
+#include <map>
+#include <atomic>
 #include <unistd.h>
 
 
@@ -43,6 +54,29 @@ using namespace std;
 
 unordered_map<string, unsigned long int> ump;
 hash<string> hash_fn;
+
+/* location cache: SDFS path -> NAS it was last found on; ordered so
+ * that the entries below a renamed directory can be dropped */
+struct loc_t {
+    string nas;
+    long time;
+};
+map<string, loc_t> loc_cache;
+
+/* backend directories known to exist, NAS prefix included -> when seen;
+ * ordered so that a directory and everything below it can be dropped */
+static map<string, long> known_dirs;
+
+/* attribute cache: SDFS path -> attributes and when they were taken */
+struct attr_t {
+    struct stat st;
+    long time;
+};
+static unordered_map<string, attr_t> attr_cache;
+static unsigned long attr_hits;
+static unsigned long attr_misses;
+static pthread_mutex_t attr_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ATTR_CACHE_MAX (256 * 1024)
 static unsigned int ncache_lifetime = 600;
 static unsigned int interval_conf = 60;
 
@@ -52,6 +86,22 @@ struct gdtnfs_conf {
     char *configfile;
     int print_info;
     int foreground;
+    unsigned int wbuf_size;
+    unsigned int wbuf_delay;
+    int writeback;
+    unsigned int fsync_window;
+    unsigned int ra_max;
+    unsigned int ra_pool;
+    unsigned int day_prefetch;
+    unsigned int dcache_max;
+    int prune;
+    char *spillfile;
+    char *inofile;
+    unsigned int attr_ttl;
+    int statfs_pattern;
+    unsigned int skel_days;
+    unsigned int fd_max;
+    unsigned int move_threads;
 };
 
 static struct gdtnfs_conf gdtnfs_conf;
@@ -62,6 +112,22 @@ static struct fuse_opt gdtnfs_opts[] = {
     GDTNFS_OPT("logfile=%s", logfile, 0),
     GDTNFS_OPT("configfile=%s", configfile, 0),
     GDTNFS_OPT("print_info", print_info, 1),
+    GDTNFS_OPT("wbuf_size=%u", wbuf_size, 0),
+    GDTNFS_OPT("wbuf_delay=%u", wbuf_delay, 0),
+    GDTNFS_OPT("writeback", writeback, 1),
+    GDTNFS_OPT("fsync_window=%u", fsync_window, 0),
+    GDTNFS_OPT("ra_max=%u", ra_max, 0),
+    GDTNFS_OPT("ra_pool=%u", ra_pool, 0),
+    GDTNFS_OPT("day_prefetch=%u", day_prefetch, 0),
+    GDTNFS_OPT("dcache_max=%u", dcache_max, 0),
+    GDTNFS_OPT("prune", prune, 1),
+    GDTNFS_OPT("spillfile=%s", spillfile, 0),
+    GDTNFS_OPT("inofile=%s", inofile, 0),
+    GDTNFS_OPT("attr_ttl=%u", attr_ttl, 0),
+    GDTNFS_OPT("statfs_pattern", statfs_pattern, 1),
+    GDTNFS_OPT("skel_days=%u", skel_days, 0),
+    GDTNFS_OPT("fd_max=%u", fd_max, 0),
+    GDTNFS_OPT("move_threads=%u", move_threads, 0),
     GDTNFS_OPT("-d", foreground, 1),
     GDTNFS_OPT("debug", foreground, 1),
     GDTNFS_OPT("-f", foreground, 1),
@@ -76,11 +142,70 @@ struct pattern_t {
     string path;
 };
 
+/* "cache <pattern> [entry=N] [attr=N] [keep_cache] [direct_io]
+ * [prealloc=SIZE]" lines */
+struct cache_policy_t {
+    string pattern;
+    double entry_timeout;
+    double attr_timeout;
+    int keep_cache;
+    int direct_io;
+    off_t prealloc;     /* bytes reserved for a new file, 0 for none */
+};
+
+
+struct ra_slot {
+    char *buf;
+    off_t off;
+    size_t len;
+    size_t cap;
+};
+
+
+/* per-open state, stored in fi->fh */
+struct gdtnfs_file {
+    int fd;
+    struct fd_entry *fde;
+    /* O_DIRECT fd of a direct_io file, -1 otherwise */
+    int dfd;
+    struct fd_entry *dfde;
+    string path;
+    string nas;
+    pthread_mutex_t lock;
+
+    /* write-behind buffer: holds [wbuf_off, wbuf_off + wbuf_len) */
+    char *wbuf;
+    size_t wbuf_len;
+    off_t wbuf_off;
+    long wbuf_time;
+    int wbuf_err;
+
+    /* readahead: two slots so the reader can drain one while the next
+     * window is being fetched */
+    struct ra_slot ra[2];
+    off_t ra_next;
+    unsigned int ra_seq;
+    size_t ra_window;
+    int ra_pending;
+    off_t ra_pend_off;
+    size_t ra_pend_len;
+    unsigned long ra_gen;
+    pthread_cond_t ra_cond;
+    unsigned long ra_hits;
+    unsigned long ra_misses;
+
+    /* write generation of the path, shared by all its handles; the
+     * slots are stale once it moves past ra_wgen */
+    shared_ptr<atomic<unsigned long> > wgen;
+    unsigned long ra_wgen;
+};
+
 
 struct dir_t {
     string name;
     uintmax_t size;
     string mount_type;
+    struct statvfs vfs;   /* as of the last read_config */
 
     bool operator<(const dir_t& right) const {
         return size == right.size ? name < right.name : size > right.size;
@@ -90,15 +215,45 @@ struct dir_t {
 
 static FILE *logfp;
 static const char *configfile;
+static int single_thread;   /* mounted with -s */
+static unordered_set<gdtnfs_file *> open_files;
+static unordered_map<string, weak_ptr<atomic<unsigned long> > > write_gens;
+/* bytes reserved on create by the prealloc policy, trimmed on the last
+ * release of the path */
+static unordered_map<string, off_t> preallocs;
+/* paths whose preallocation is being trimmed */
+static unordered_set<string> trimming;
+static pthread_cond_t trim_cond = PTHREAD_COND_INITIALIZER;
 static vector<pattern_t> target_patterns;
 static vector<dir_t> target_dirs;
+static vector<cache_policy_t> cache_policies;
+/* NAS each rule spilled over to when its own NAS was full: pattern -> NAS */
+static unordered_map<string, unordered_set<string> > spill_dirs;
+static string spillfile;
 static string rootdir;
 static mode_t default_umask;
 
+/* largest write/read/readahead negotiated in writeback mode; libfuse >= 3.6
+ * on Linux >= 4.20 turns a size above 128KiB into the matching max_pages,
+ * older ones cap it at 128KiB */
+#define WRITEBACK_MAX_WRITE (1024 * 1024)
+
+#define RA_MIN_WINDOW (128 * 1024)
+#define RA_THREADS 2
+
+/* how much of the next day the prefetcher warms up */
+#define PREFETCH_MAX_FILES 64
+#define PREFETCH_HEAD (64 * 1024)
+
 #define USE_LOCK 1
 #if USE_LOCK
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static deque<gdtnfs_file *> ra_queue;
+static size_t ra_pool_used;
+static pthread_mutex_t ra_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_queue_cond = PTHREAD_COND_INITIALIZER;
 
 #define PRINT_DEBUG 0
 #if PRINT_DEBUG
@@ -109,8 +264,13 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define PRINT_ERR(fmt, ...) print_msg(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
 
+#define PRINT_INFO(fmt, ...) do { \
+    if(gdtnfs_conf.print_info) print_msg(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__); \
+} while(0)
+
 
 static void print_dirs(void);
+static void print_stats(void);
 static void read_config(void);
 
 static void print_msg(const char *function, int line, const char *fmt, ...)
@@ -132,6 +292,143 @@ static void print_msg(const char *function, int line, const char *fmt, ...)
     }
 }
 
+/*
+ * O_PATH fds of the NAS roots. Backend calls go through the *at()
+ * variants relative to them, so the kernel does not walk the mount
+ * prefix for every call. read_config opens them. A root is never
+ * closed while the daemon runs, so an op resolved against an older
+ * config still holds a valid one.
+ */
+static unordered_map<string, int> root_fds;
+static pthread_mutex_t root_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* (re)open the root of nas, e.g. after the NAS was mounted again */
+static void root_open(const string &nas)
+{
+    struct stat st, rst;
+
+    if(stat(nas.c_str(), &st) != 0){
+        return;
+    }
+
+    pthread_mutex_lock(&root_mutex);
+    auto itr = root_fds.find(nas);
+    if(itr != root_fds.end() && fstat(itr->second, &rst) == 0 &&
+       rst.st_dev == st.st_dev && rst.st_ino == st.st_ino){
+        pthread_mutex_unlock(&root_mutex);
+        return;
+    }
+    int fd = open(nas.c_str(), O_PATH | O_DIRECTORY);
+    if(fd == -1){
+        PRINT_ERR("Error: open(%s, O_PATH) %s", nas.c_str(), strerror(errno));
+    }else{
+        if(itr != root_fds.end()){
+            PRINT_ERR("root of %s changed, reopened", nas.c_str());
+        }
+        root_fds[nas] = fd;
+    }
+    pthread_mutex_unlock(&root_mutex);
+}
+
+
+/* dirfd and path relative to it for fpath; AT_FDCWD and fpath itself
+ * when no NAS root holds it */
+static int root_at(const char *fpath, const char **rel)
+{
+    int dirfd = AT_FDCWD;
+    size_t best = 0;
+
+    *rel = fpath;
+    pthread_mutex_lock(&root_mutex);
+    for(auto itr = root_fds.begin(); itr != root_fds.end(); ++itr){
+        size_t len = itr->first.size();
+        if(len > best && strncmp(fpath, itr->first.c_str(), len) == 0 &&
+           (fpath[len] == '/' || fpath[len] == '\0')){
+            dirfd = itr->second;
+            best = len;
+        }
+    }
+    pthread_mutex_unlock(&root_mutex);
+
+    if(best > 0){
+        *rel = fpath + best;
+        while(**rel == '/'){
+            (*rel)++;
+        }
+        if(**rel == '\0'){
+            *rel = ".";
+        }
+    }
+    return dirfd;
+}
+
+
+static int nas_lstat(const char *fpath, struct stat *st)
+{
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    return fstatat(dirfd, rel, st, AT_SYMLINK_NOFOLLOW);
+}
+
+
+static int nas_stat(const char *fpath, struct stat *st)
+{
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    return fstatat(dirfd, rel, st, 0);
+}
+
+
+static int nas_open(const char *fpath, int flags, mode_t mode)
+{
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    return openat(dirfd, rel, flags, mode);
+}
+
+
+static DIR *nas_opendir(const char *fpath)
+{
+    int fd = nas_open(fpath, O_RDONLY | O_DIRECTORY, 0);
+    if(fd == -1){
+        return NULL;
+    }
+    DIR *dp = fdopendir(fd);
+    if(dp == NULL){
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    return dp;
+}
+
+
+static int nas_mkdir(const char *fpath, mode_t mode)
+{
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    return mkdirat(dirfd, rel, mode);
+}
+
+
+static int nas_unlink(const char *fpath, int flags)
+{
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    return unlinkat(dirfd, rel, flags);
+}
+
+
+static int nas_rename(const char *from, const char *to)
+{
+    const char *rfrom, *rto;
+    int dfrom = root_at(from, &rfrom);
+    int dto = root_at(to, &rto);
+    return renameat(dfrom, rfrom, dto, rto);
+}
+
+
 bool exist_ump(string file_pass)
 {
     auto time_now = chrono::system_clock::now();
@@ -158,6 +455,170 @@ int add_ump(string file_pass)
   return 0;
 }
 
+static long now_ms(void);
+
+/* caller holds mutex */
+static bool find_loc(const char *path, string &nas)
+{
+    auto itr = loc_cache.find(path);
+    if(itr == loc_cache.end()){
+        return false;
+    }
+    /* a hit does not extend the entry, so a file moved on the NAS
+     * directly is found again after ncache_lifetime at the latest */
+    nas = itr->second.nas;
+    return true;
+}
+
+
+static void loc_set(const string &path, const string &nas)
+{
+    if(nas.empty()){
+        return;
+    }
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    loc_t loc = {nas, now_ms()};
+    loc_cache[path] = loc;
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+
+static void loc_del(const string &path)
+{
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    loc_cache.erase(path);
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+
+/* drop the entries below a renamed or removed directory */
+static void loc_del_tree(const string &path)
+{
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    loc_cache.erase(loc_cache.lower_bound(path + "/"),
+                    loc_cache.lower_bound(path + "0"));
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+
+/* caller holds attr_mutex; NULL when missing or expired */
+static struct stat *attr_find_locked(const char *path)
+{
+    auto itr = attr_cache.find(path);
+    if(itr == attr_cache.end()){
+        return NULL;
+    }
+    if(now_ms() - itr->second.time > gdtnfs_conf.attr_ttl){
+        attr_cache.erase(itr);
+        return NULL;
+    }
+    return &itr->second.st;
+}
+
+
+static bool attr_get(const char *path, struct stat *st)
+{
+    bool hit = false;
+
+    if(gdtnfs_conf.attr_ttl == 0){
+        return false;
+    }
+    pthread_mutex_lock(&attr_mutex);
+    struct stat *cached = attr_find_locked(path);
+    if(cached != NULL){
+        *st = *cached;
+        hit = true;
+        attr_hits++;
+    }else{
+        attr_misses++;
+    }
+    pthread_mutex_unlock(&attr_mutex);
+
+    return hit;
+}
+
+
+static void attr_put(const string &path, const struct stat *st)
+{
+    if(gdtnfs_conf.attr_ttl == 0){
+        return;
+    }
+    pthread_mutex_lock(&attr_mutex);
+    if(attr_cache.size() >= ATTR_CACHE_MAX){
+        attr_cache.clear();
+    }
+    attr_t attr = {*st, now_ms()};
+    attr_cache[path] = attr;
+    pthread_mutex_unlock(&attr_mutex);
+}
+
+
+static void attr_del(const string &path)
+{
+    pthread_mutex_lock(&attr_mutex);
+    attr_cache.erase(path);
+    pthread_mutex_unlock(&attr_mutex);
+}
+
+
+/* drop path and everything cached below it */
+static void attr_del_tree(const string &path)
+{
+    string prefix = (path == "/") ? path : path + "/";
+
+    pthread_mutex_lock(&attr_mutex);
+    attr_cache.erase(path);
+    for(auto itr = attr_cache.begin(); itr != attr_cache.end(); ){
+        if(itr->first.compare(0, prefix.size(), prefix) == 0){
+            itr = attr_cache.erase(itr);
+        }else{
+            ++itr;
+        }
+    }
+    pthread_mutex_unlock(&attr_mutex);
+}
+
+
+/* a name was added or removed in the directory holding path */
+static void attr_del_parent(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    attr_del((p == path) ? string("/") : string(path, p - path));
+}
+
+
+/* keep cached attributes in step with a write of [offset, end) */
+static void attr_write(const char *path, off_t end)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&attr_mutex);
+    struct stat *st = attr_find_locked(path);
+    if(st != NULL){
+        if(st->st_size < end){
+            st->st_size = end;
+            st->st_blocks = (end + 511) / 512;
+        }
+        st->st_mtim = now;
+        st->st_ctim = now;
+    }
+    pthread_mutex_unlock(&attr_mutex);
+}
+
+
 vector<string> split_path(const string path, char seq) {
   vector<string> vec_path;
   stringstream ss_path(path);
@@ -180,26 +641,48 @@ static int file_exist(const char * filename, const char * pre)
     vector<string> vec_path = split_path(path, '/'); 
 	
 	string s = "";
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
     for(auto itr = vec_path.begin(); itr != vec_path.end(); ++itr)
 	{
 	    if(*itr != "") {
 	        s = s + "/" + *itr;
 	        if(exist_ump(s)) {
+#if USE_LOCK
+                pthread_mutex_unlock(&mutex);
+#endif
 	    	   return 0;
 	        }
 		}
 	}
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
 	
 	
+	/* the stats run unlocked so that other paths resolve meanwhile;
+	 * the components of an opened NAS root need none */
+	const char *rel;
+	size_t pre_len = (root_at(pre, &rel) != AT_FDCWD) ? strlen(pre) : 0;
 	s = "";
 	for(auto itr = vec_path.begin(); itr != vec_path.end(); ++itr)
 	{
         if(*itr != "") {
    	        s = s + "/" + *itr;
+			if (s.length() <= pre_len) {
+				continue;
+			}
 			char s_path[PATH_MAX] = {0};
 			s.copy(s_path, s.length());
-			if (lstat(s_path, &buf) != 0) {
+			if (nas_lstat(s_path, &buf) != 0) {
+#if USE_LOCK
+                pthread_mutex_lock(&mutex);
+#endif
 			    add_ump(s);
+#if USE_LOCK
+                pthread_mutex_unlock(&mutex);
+#endif
 				return 0;
 			}
 		}
@@ -217,928 +700,5475 @@ void print(unordered_map<string, unsigned long int> tmp_ump)
   cout << "" << endl;
 }
 
-static int gdtnfs_fullpath_process(char fpath[PATH_MAX], const char *path)
-{  
-    int len = 0;
+static int path_depth(const char *path)
+{
+    int depth = 0;
 
-#if USE_LOCK
-    pthread_mutex_lock(&mutex);
-#endif
-    size_t size = target_dirs.size();
-    for (unsigned int i = 0; i < size; i++) {
-        string dir_name = target_dirs[i].name;
-        const char *dir_name_c = dir_name.c_str();
-        PRINT("%s %s", path, dir_name_c);
-        if(file_exist(path, dir_name_c)){
-            PRINT("%s %s", path, fpath);
-            strcpy(fpath, dir_name_c);
-            strncat(fpath, path, PATH_MAX - strlen(fpath) + 1);
-            len = strlen(fpath);
-            break;
+    for(const char *p = path; *p; p++){
+        if(*p != '/' && (p == path || p[-1] == '/')){
+            depth++;
         }
     }
-#if USE_LOCK
-    pthread_mutex_unlock(&mutex);
-#endif
 
-    PRINT("%s -> %s", path, fpath);
-    
-    return len;
+    return depth;
 }
 
 
-static int mkdir_parents_process(const char *path, mode_t mode)
+/* can pattern match something below path? */
+static bool pattern_below(const string &pattern, const char *path)
 {
-    struct stat sb = {0};
-    mode_t mode_mkdir = mode & ~default_umask;
-    int ret = 0;
-
-    ret = stat(path, &sb);
-    if(ret == 0){
-        if(!S_ISDIR(sb.st_mode)){
-            PRINT_ERR("Error: Not a directory: %s", path);
-            return -1;
+    int depth = path_depth(path);
+    int n = 0;
+    size_t cut = 0;
+
+    for(size_t i = 0; i < pattern.size(); i++){
+        if(pattern[i] != '/' && (i == 0 || pattern[i - 1] == '/')){
+            if(n == depth){
+                cut = i;
+                break;
+            }
+            n++;
         }
-        return 0;
     }
-
-    ret = mkdir(path, mode_mkdir);
-
-    if(ret != 0){
-        PRINT_ERR("Error: mkdir(%s) %s", path, strerror(errno));
-        return -1;
+    if(cut == 0){
+        return false;
     }
 
-    return 0;
+    if(depth == 0){
+        return true;
+    }
+    string head = pattern.substr(0, cut - 1);
+    return fnmatch(head.c_str(), path, FNM_PATHNAME) == 0;
 }
 
 
-static int mkdir_parents(const char *path, mode_t mode)
+/* caller holds mutex. Collects the NAS that can hold path or anything
+ * below it according to the rules and their spillover; false when some
+ * of it may have been placed by default, i.e. on any NAS */
+static bool nas_candidates_locked(const char *path, unordered_set<string> &nas)
 {
-    char buf[PATH_MAX] = {0};
-    char *p = NULL;
-    int ret = 0;
-
-    strcpy(buf, path);
-
-    for(p = strchr(buf + 1, '/'); p; p = strchr(p + 1, '/')){
-        *p = '\0';
-        ret = mkdir_parents_process(buf, mode);
-        if(ret != 0){
-            return -1;
+    size_t size = target_patterns.size();
+    for (unsigned int i = 0; i < size; i++) {
+        const string &pattern = target_patterns[i].pattern;
+        bool full = (fnmatch(pattern.c_str(), path, FNM_PATHNAME | FNM_LEADING_DIR) == 0);
+        if(full || pattern_below(pattern, path)){
+            nas.insert(target_patterns[i].path);
+            auto itr = spill_dirs.find(pattern);
+            if(itr != spill_dirs.end()){
+                nas.insert(itr->second.begin(), itr->second.end());
+            }
+        }
+        /* later rules never win below a fully matching one */
+        if(full){
+            return true;
         }
-        *p = '/';
     }
 
-    return 0;
+    return false;
 }
 
 
-static int check_fs_size(string path)
+/* caller holds mutex; the NAS to probe or list for path, in NAS order */
+static void list_dirs_locked(const char *path, vector<string> &dirs)
 {
-    const uintmax_t min_fs_size = 100UL * 1024 * 1024 * 1024;
+    unordered_set<string> nas;
+    bool pruned = gdtnfs_conf.prune && nas_candidates_locked(path, nas);
 
     size_t size = target_dirs.size();
     for (unsigned int i = 0; i < size; i++) {
-        if(path == target_dirs[i].name){
-            if(target_dirs[i].size < min_fs_size){
-                return -1;
-            }else{
-                return 0;
-            }
+        if(!pruned || nas.count(target_dirs[i].name)){
+            dirs.push_back(target_dirs[i].name);
         }
     }
-
-    return -1;
 }
 
 
-static int check_pattern(char fpath[PATH_MAX], const char *path)
+static void list_dirs(const char *path, vector<string> &dirs)
 {
-    int ret = -1;
-    
 #if USE_LOCK
     pthread_mutex_lock(&mutex);
 #endif
-    size_t size = target_patterns.size();
-    for (unsigned int i = 0; i < size; i++) {
-        const char *pattern = target_patterns[i].pattern.c_str();
-        int matched = fnmatch(pattern, path, FNM_PATHNAME | FNM_LEADING_DIR);
-        if(matched == 0){
-            PRINT("OK_PATTERN: %s -> %s\n", pattern, path);
-            if(check_fs_size(target_patterns[i].path) == 0){
-                PRINT("OK_SIZE: %s -> %s\n", pattern, path);
-                const char *target_path = target_patterns[i].path.c_str();
-                strcpy(fpath, target_path);
-                strncat(fpath, path, PATH_MAX - strlen(fpath) + 1);
-                ret = 0;
-            }
-
-            break;
-        }
-    }
+    list_dirs_locked(path, dirs);
 #if USE_LOCK
     pthread_mutex_unlock(&mutex);
 #endif
+}
 
-    if(ret == -1){
-        PRINT("NG: %s\n", path);
+
+/* caller holds mutex */
+static void record_spill_locked(const string &pattern, const string &nas)
+{
+    if(!spill_dirs[pattern].insert(nas).second){
+        return;
     }
+    PRINT_ERR("spill: %s -> %s", pattern.c_str(), nas.c_str());
 
-    return ret;
+    FILE *fp = fopen(spillfile.c_str(), "a");
+    if(fp == NULL){
+        PRINT_ERR("Error: fopen(%s) %s", spillfile.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(fp, "%s %s\n", pattern.c_str(), nas.c_str());
+    fclose(fp);
 }
 
 
-static int search_path(char fpath[PATH_MAX], const char *path)
+static void read_spill(void)
 {
-    char buf[PATH_MAX] = {0};
-    char tmp[PATH_MAX] = {0};
-    char *dir_name = NULL;
+    char buf[PATH_MAX * 2] = {0};
+    char pattern[PATH_MAX] = {0};
+    char path[PATH_MAX] = {0};
+
+    FILE *fp = fopen(spillfile.c_str(), "r");
+    if(fp == NULL){
+        return;
+    }
+    while(fgets(buf, sizeof(buf), fp) != NULL){
+        if(sscanf(buf, "%s%s", pattern, path) == 2){
+            spill_dirs[pattern].insert(path);
+        }
+    }
+    fclose(fp);
+}
+
+
+/*
+ * Inode numbers seen through SDFS: the NAS id in the top 16 bits and the
+ * backend inode below, so equal backend numbers on different NAS never
+ * collide. Backend inodes too large for that get a number from ino_table.
+ * NAS ids and table entries are appended to inofile so that the numbers
+ * stay the same across restarts.
+ */
+#define INO_NAS_SHIFT 48
+#define INO_LOCAL_MASK (((uint64_t)1 << INO_NAS_SHIFT) - 1)
+#define INO_TABLE_ID ((uint64_t)0xffff)
+
+struct ino_key {
+    uint64_t nas;
+    uint64_t ino;
+
+    bool operator==(const ino_key& right) const {
+        return nas == right.nas && ino == right.ino;
+    }
+};
+
+struct ino_key_hash {
+    size_t operator()(const ino_key& key) const {
+        return key.ino * 0x9e3779b97f4a7c15ULL ^ key.nas;
+    }
+};
+
+static pthread_mutex_t ino_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<string, uint64_t> nas_ids;
+static unordered_map<ino_key, uint64_t, ino_key_hash> ino_table;
+static uint64_t ino_table_next = 1;
+static uint64_t nas_id_next = 1;
+static string inofile;
+static FILE *inofp;
+
+
+static uint64_t nas_id(const string &nas)
+{
+    pthread_mutex_lock(&ino_mutex);
+    auto itr = nas_ids.find(nas);
+    if(itr != nas_ids.end()){
+        uint64_t id = itr->second;
+        pthread_mutex_unlock(&ino_mutex);
+        return id;
+    }
+
+    uint64_t id = nas_id_next++;
+    if(id >= INO_TABLE_ID){
+        PRINT_ERR("Error: no NAS id left for %s", nas.c_str());
+        id = 0;
+    }
+    nas_ids[nas] = id;
+    if(inofp != NULL){
+        fprintf(inofp, "nas %" PRIu64 " %s\n", id, nas.c_str());
+    }
+    pthread_mutex_unlock(&ino_mutex);
+
+    return id;
+}
+
+
+static ino_t compose_ino(uint64_t id, ino_t ino)
+{
+    if((uint64_t)ino <= INO_LOCAL_MASK){
+        return (id << INO_NAS_SHIFT) | ino;
+    }
+
+    ino_key key = {id, (uint64_t)ino};
+    pthread_mutex_lock(&ino_mutex);
+    auto itr = ino_table.find(key);
+    if(itr != ino_table.end()){
+        uint64_t res = itr->second;
+        pthread_mutex_unlock(&ino_mutex);
+        return res;
+    }
+
+    uint64_t res = (INO_TABLE_ID << INO_NAS_SHIFT) | (ino_table_next++ & INO_LOCAL_MASK);
+    ino_table[key] = res;
+    if(inofp != NULL){
+        fprintf(inofp, "ino %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", id, key.ino, res);
+    }
+    pthread_mutex_unlock(&ino_mutex);
+
+    return res;
+}
+
+
+static ino_t map_ino(const string &nas, ino_t ino)
+{
+    return compose_ino(nas_id(nas), ino);
+}
+
+
+static void read_inofile(void)
+{
+    char buf[PATH_MAX * 2] = {0};
+    char path[PATH_MAX] = {0};
+    uint64_t id, ino, res;
+
+    /* an id or table number given twice would make two files share an
+     * inode number; such lines (a hand-edited file) are skipped and the
+     * name gets a fresh number */
+    unordered_set<uint64_t> ids_seen;
+    unordered_set<uint64_t> table_seen;
+
+    FILE *fp = fopen(inofile.c_str(), "r");
+    if(fp != NULL){
+        while(fgets(buf, sizeof(buf), fp) != NULL){
+            if(sscanf(buf, "nas %" SCNu64 " %s", &id, path) == 2){
+                if(id == 0 || id >= INO_TABLE_ID || nas_ids.count(path) ||
+                   !ids_seen.insert(id).second){
+                    PRINT_ERR("Error: %s: bad or duplicate NAS id: %s", inofile.c_str(), buf);
+                    continue;
+                }
+                nas_ids[path] = id;
+                nas_id_next = max(nas_id_next, id + 1);
+            }else if(sscanf(buf, "ino %" SCNu64 " %" SCNu64 " %" SCNu64, &id, &ino, &res) == 3){
+                ino_key key = {id, ino};
+                if((res >> INO_NAS_SHIFT) != INO_TABLE_ID || ino_table.count(key) ||
+                   !table_seen.insert(res).second){
+                    PRINT_ERR("Error: %s: bad or duplicate inode entry: %s", inofile.c_str(), buf);
+                    continue;
+                }
+                ino_table[key] = res;
+                ino_table_next = max(ino_table_next, (res & INO_LOCAL_MASK) + 1);
+            }
+        }
+        fclose(fp);
+    }
+
+    inofp = fopen(inofile.c_str(), "a");
+    if(inofp == NULL){
+        PRINT_ERR("Error: fopen(%s) %s", inofile.c_str(), strerror(errno));
+        return;
+    }
+    setvbuf(inofp, NULL, _IOLBF, 0);
+}
+
+
+/* a probe of all NAS in progress; resolutions of the same path wait for it */
+struct flight_t {
+    pthread_cond_t cond;
+    int done;
+    int waiters;
+    string nas;     /* "" when no NAS has the path */
+};
+static unordered_map<string, flight_t *> flights;
+static unsigned long flight_probes;
+static unsigned long flight_joins;
+
+
+/* caller holds mutex; the last one to leave frees the flight */
+static void flight_leave_locked(flight_t *f)
+{
+    if(f->done && f->waiters == 0){
+        pthread_cond_destroy(&f->cond);
+        delete f;
+    }
+}
+
+
+static int gdtnfs_fullpath_process(char fpath[PATH_MAX], const char *path)
+{  
     int len = 0;
+    string nas;
 
-    if(check_pattern(fpath, path) == 0){
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    if(find_loc(path, nas)){
+        strcpy(fpath, nas.c_str());
+        strncat(fpath, path, PATH_MAX - strlen(fpath) - 1);
         len = strlen(fpath);
-    }else{
 #if USE_LOCK
-        pthread_mutex_lock(&mutex);
+        pthread_mutex_unlock(&mutex);
 #endif
-        const char *dir_name_c = target_dirs[0].name.c_str();
-        strcpy(fpath, dir_name_c);
+        return len;
+    }
+
+    auto itr = flights.find(path);
+    if(itr != flights.end()){
+        flight_t *f = itr->second;
+        f->waiters++;
+        flight_joins++;
+#if USE_LOCK
+        while(!f->done){
+            pthread_cond_wait(&f->cond, &mutex);
+        }
+#endif
+        nas = f->nas;
+        f->waiters--;
+        flight_leave_locked(f);
 #if USE_LOCK
         pthread_mutex_unlock(&mutex);
 #endif
-        strncat(fpath, path, PATH_MAX - strlen(fpath) + 1);
-        len = strlen(fpath);
+        if(!nas.empty()){
+            strcpy(fpath, nas.c_str());
+            strncat(fpath, path, PATH_MAX - strlen(fpath) - 1);
+            len = strlen(fpath);
+        }
+        PRINT("%s -> %s (joined)", path, fpath);
+        return len;
     }
-    
-    strcpy(tmp, fpath);
-    dir_name = dirname(tmp);
-    strcpy(buf, dir_name);
-    strncat(buf, "/", PATH_MAX - strlen(buf) + 1);
-    PRINT("buf: %s", buf);
-    int ret = mkdir_parents(buf, 0777);
-    if(ret != 0){
-        PRINT_ERR("Error: mkdir_parents(%s) %s", buf, strerror(errno));
+
+    flight_t *f = new flight_t();
+    pthread_cond_init(&f->cond, NULL);
+    f->done = 0;
+    f->waiters = 0;
+    flights[path] = f;
+    flight_probes++;
+
+    vector<string> dirs;
+    list_dirs_locked(path, dirs);
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    size_t size = dirs.size();
+    for (unsigned int i = 0; i < size; i++) {
+        string dir_name = dirs[i];
+        const char *dir_name_c = dir_name.c_str();
+        PRINT("%s %s", path, dir_name_c);
+        if(file_exist(path, dir_name_c)){
+            PRINT("%s %s", path, fpath);
+            strcpy(fpath, dir_name_c);
+            strncat(fpath, path, PATH_MAX - strlen(fpath) + 1);
+            len = strlen(fpath);
+            nas = dir_name;
+            break;
+        }
     }
-    PRINT("buf: %d", ret);
 
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    if(!nas.empty()){
+        loc_t loc = {nas, now_ms()};
+        loc_cache[path] = loc;
+    }
+    f->nas = nas;
+    f->done = 1;
+    flights.erase(path);
+    pthread_cond_broadcast(&f->cond);
+    flight_leave_locked(f);
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    PRINT("%s -> %s", path, fpath);
+    
     return len;
 }
 
 
-static void gdtnfs_fullpath(char fpath[PATH_MAX], const char *path, int flag)
+static string strip_slash(const char *dir)
 {
-    int ret = gdtnfs_fullpath_process(fpath, path);
-    
-    PRINT("%s -> %s", path, fpath);
-
-    if((ret == 0) && (flag == 1)){
-        search_path(fpath, path);
+    string s = dir;
+    while(s.size() > 1 && s[s.size() - 1] == '/'){
+        s.erase(s.size() - 1);
     }
-    
-    
-    PRINT("%s -> %s", path, fpath);
+    return s;
 }
 
 
-static void *config_thread(void *ptr)
+/* caller holds mutex */
+static bool known_dir_locked(const string &dir)
 {
-    int ret = pthread_detach(pthread_self());
-    if(ret != 0){
-        PRINT_ERR("Error: pthread_detach() %s\n", strerror(errno));
-    }
+    return known_dirs.find(dir) != known_dirs.end();
+}
 
-    while(1){
-        read_config();
-		sleep(interval_conf);
-    }
 
-    return NULL;
+bool delete_ump(string file_pass);
+
+/* caller holds mutex; a directory that exists is no longer a miss */
+static void known_dir_add_locked(const string &dir)
+{
+    known_dirs[dir] = now_ms();
+    delete_ump(dir);
 }
 
 
-static void start_config_thread(void)
+static void known_dir_add(const char *dir)
 {
-    pthread_t th;
-    int ret = pthread_create(&th, NULL, &config_thread, NULL);
-    if(ret != 0){
-        fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    string s = strip_slash(dir);
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    known_dir_add_locked(s);
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
 }
 
-bool delete_ump(string file_pass)
+
+/* drop dir and every known directory below it */
+static void known_dir_del(const char *dir)
 {
-  auto itr = ump.find(file_pass);
-  if (itr != ump.end())
-	{
-	  ump.erase(itr);
-	  return true;
-	}
-  else
-	{
-	  return false;
-	}
+    string s = strip_slash(dir);
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    known_dirs.erase(s);
+    known_dirs.erase(known_dirs.lower_bound(s + "/"), known_dirs.lower_bound(s + "0"));
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
 }
 
 
-static void organize_ump(unsigned int memory_span)
+/* caller holds mutex */
+static void organize_known(unsigned int memory_span)
 {
-    auto time_now = chrono::system_clock::now();
-	auto time_ms = chrono::time_point_cast<chrono::milliseconds>(time_now);
-	long time = time_ms.time_since_epoch().count();
-	vector<string> vec_erase;
+    long time = now_ms();
 
-	for (auto itr = ump.begin(); itr != ump.end(); itr++)
-	{
-  	    if(time - itr->second > memory_span)
-		{
-		    vec_erase.push_back(itr->first);
-		}
-	}
+    for(auto itr = known_dirs.begin(); itr != known_dirs.end(); ){
+        if(time - itr->second > memory_span){
+            itr = known_dirs.erase(itr);
+        }else{
+            ++itr;
+        }
+    }
+}
 
-	for(auto itr = vec_erase.begin(); itr != vec_erase.end(); ++itr)
-	{
-	  	PRINT(" ** delete ncache %s", *itr);
-	    delete_ump(*itr);
-	}
-	
-	return;
+
+static int mkdir_parents_process(const char *path, mode_t mode)
+{
+    struct stat sb = {0};
+    mode_t mode_mkdir = mode & ~default_umask;
+    int ret = 0;
+
+    ret = nas_stat(path, &sb);
+    if(ret == 0){
+        if(!S_ISDIR(sb.st_mode)){
+            PRINT_ERR("Error: Not a directory: %s", path);
+            return -1;
+        }
+        return 0;
+    }
+
+    ret = nas_mkdir(path, mode_mkdir);
+
+    /* another writer may have created it since the stat */
+    if(ret != 0 && errno != EEXIST){
+        PRINT_ERR("Error: mkdir(%s) %s", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
 }
 
 
-static void *ncache_thread(void *ptr)
+static int mkdir_parents(const char *path, mode_t mode)
+{
+    char buf[PATH_MAX] = {0};
+    char *p = NULL;
+    int ret = 0;
+
+    strcpy(buf, path);
+
+    /* usually the whole directory is known and nothing is stat'ed */
+    string dir = strip_slash(buf);
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    bool known = known_dir_locked(dir);
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+    if(known){
+        return 0;
+    }
+
+    for(p = strchr(buf + 1, '/'); p; p = strchr(p + 1, '/')){
+        *p = '\0';
+#if USE_LOCK
+        pthread_mutex_lock(&mutex);
+#endif
+        known = known_dir_locked(buf);
+#if USE_LOCK
+        pthread_mutex_unlock(&mutex);
+#endif
+        if(!known){
+            ret = mkdir_parents_process(buf, mode);
+            if(ret != 0){
+                return -1;
+            }
+            known_dir_add(buf);
+        }
+        *p = '/';
+    }
+
+    return 0;
+}
+
+
+/*
+ * An op on fpath failed with ENOENT: its directory may have been removed
+ * on the NAS while it was in known_dirs. Forget it and its parents and
+ * create them again; true when the op is worth retrying.
+ */
+static bool parents_lost(const char *fpath)
+{
+    string dir = fpath;
+    dir.erase(dir.rfind('/'));
+    if(dir.empty()){
+        return false;
+    }
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    bool known = known_dir_locked(dir);
+    for(string s = dir; !s.empty(); s.erase(s.rfind('/'))){
+        known_dirs.erase(s);
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+    if(!known){
+        return false;
+    }
+
+    PRINT_ERR("lost directory: %s", dir.c_str());
+    known_dir_del(dir.c_str());
+    return mkdir_parents((dir + "/").c_str(), 0777) == 0;
+}
+
+
+static int check_fs_size(string path)
+{
+    const uintmax_t min_fs_size = 100UL * 1024 * 1024 * 1024;
+
+    size_t size = target_dirs.size();
+    for (unsigned int i = 0; i < size; i++) {
+        if(path == target_dirs[i].name){
+            if(target_dirs[i].size < min_fs_size){
+                return -1;
+            }else{
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+
+static int check_pattern(char fpath[PATH_MAX], const char *path, string &rule)
+{
+    int ret = -1;
+    
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    size_t size = target_patterns.size();
+    for (unsigned int i = 0; i < size; i++) {
+        const char *pattern = target_patterns[i].pattern.c_str();
+        int matched = fnmatch(pattern, path, FNM_PATHNAME | FNM_LEADING_DIR);
+        if(matched == 0){
+            PRINT("OK_PATTERN: %s -> %s\n", pattern, path);
+            rule = target_patterns[i].pattern;
+            if(check_fs_size(target_patterns[i].path) == 0){
+                PRINT("OK_SIZE: %s -> %s\n", pattern, path);
+                const char *target_path = target_patterns[i].path.c_str();
+                strcpy(fpath, target_path);
+                strncat(fpath, path, PATH_MAX - strlen(fpath) + 1);
+                ret = 0;
+            }
+
+            break;
+        }
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    if(ret == -1){
+        PRINT("NG: %s\n", path);
+    }
+
+    return ret;
+}
+
+
+static int search_path(char fpath[PATH_MAX], const char *path)
+{
+    char buf[PATH_MAX] = {0};
+    char tmp[PATH_MAX] = {0};
+    char *dir_name = NULL;
+    int len = 0;
+    string rule;
+
+    if(check_pattern(fpath, path, rule) == 0){
+        len = strlen(fpath);
+    }else{
+#if USE_LOCK
+        pthread_mutex_lock(&mutex);
+#endif
+        const char *dir_name_c = target_dirs[0].name.c_str();
+        strcpy(fpath, dir_name_c);
+        if(!rule.empty()){
+            record_spill_locked(rule, target_dirs[0].name);
+        }
+#if USE_LOCK
+        pthread_mutex_unlock(&mutex);
+#endif
+        strncat(fpath, path, PATH_MAX - strlen(fpath) + 1);
+        len = strlen(fpath);
+    }
+    
+    strcpy(tmp, fpath);
+    dir_name = dirname(tmp);
+    strcpy(buf, dir_name);
+    strncat(buf, "/", PATH_MAX - strlen(buf) + 1);
+    PRINT("buf: %s", buf);
+    int ret = mkdir_parents(buf, 0777);
+    if(ret != 0){
+        PRINT_ERR("Error: mkdir_parents(%s) %s", buf, strerror(errno));
+    }
+    PRINT("buf: %d", ret);
+
+    return len;
+}
+
+
+static void gdtnfs_fullpath(char fpath[PATH_MAX], const char *path, int flag)
+{
+    int ret = gdtnfs_fullpath_process(fpath, path);
+    
+    PRINT("%s -> %s", path, fpath);
+
+    if((ret == 0) && (flag == 1)){
+        search_path(fpath, path);
+    }
+    
+    
+    PRINT("%s -> %s", path, fpath);
+}
+
+
+/* fpath gave ENOENT. If it came from the location cache the file may
+ * have been moved or removed on the NAS directly: drop the entry and
+ * probe again. true when the probe found the file somewhere else */
+static bool loc_retry(const char *path, char fpath[PATH_MAX])
+{
+    string nas;
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    bool cached = find_loc(path, nas);
+    if(cached){
+        loc_cache.erase(path);
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+    if(!cached){
+        return false;
+    }
+
+    string old = fpath;
+    if(gdtnfs_fullpath_process(fpath, path) == 0){
+        return false;
+    }
+    if(old == fpath){
+        return false;
+    }
+    PRINT_ERR("%s moved from %s to %s", path, old.c_str(), fpath);
+    return true;
+}
+
+
+static long now_ms(void)
+{
+    auto time_now = chrono::system_clock::now();
+    auto time_ms = chrono::time_point_cast<chrono::milliseconds>(time_now);
+    return time_ms.time_since_epoch().count();
+}
+
+
+static struct gdtnfs_file *get_file(struct fuse_file_info *fi)
+{
+    return (struct gdtnfs_file *)(uintptr_t)fi->fh;
+}
+
+
+static string fpath_nas(const char *fpath)
+{
+    string nas;
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    size_t size = target_dirs.size();
+    for (unsigned int i = 0; i < size; i++) {
+        const string &name = target_dirs[i].name;
+        if(strncmp(fpath, name.c_str(), name.size()) == 0 &&
+           (fpath[name.size()] == '/' || fpath[name.size()] == '\0')){
+            nas = name;
+            break;
+        }
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    return nas;
+}
+
+
+/*
+ * Backend fd pool. Read-only opens of one NAS file with the same flags
+ * share a single fd, since all I/O goes through pread/pwrite at explicit
+ * offsets. A released read-only fd stays open for FD_IDLE_MS so that the
+ * next open of the file skips the NAS round trip; idle fds are closed
+ * oldest first when the pool holds more than fd_max. Writable fds are
+ * never pooled: the NFS client flushes a file's dirty pages and checks
+ * for write errors when its fd is closed, and other clients only see the
+ * data after that, so each writable open gets its own fd, closed on
+ * release.
+ */
+#define FD_IDLE_MS 5000
+
+struct fd_entry {
+    string fpath;
+    int flags;
+    int fd;
+    int refs;
+    int pooled;     /* reachable from fd_pool, new opens may share it */
+    long idle_since;
+    list<fd_entry *>::iterator lru;
+};
+
+static unordered_map<string, vector<fd_entry *> > fd_pool;
+static list<fd_entry *> fd_idle;    /* unused fds, oldest first */
+static size_t fd_count;
+static unsigned long fd_opens;
+static unsigned long fd_shared;
+static unsigned long fd_warm;
+static unsigned long fd_evicted;
+static pthread_mutex_t fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* caller holds fd_mutex */
+static void fd_unpool_locked(struct fd_entry *e)
+{
+    if(!e->pooled){
+        return;
+    }
+    vector<fd_entry *> &v = fd_pool[e->fpath];
+    v.erase(find(v.begin(), v.end(), e));
+    if(v.empty()){
+        fd_pool.erase(e->fpath);
+    }
+    e->pooled = 0;
+}
+
+
+/* caller holds fd_mutex; fds to close once it is released go to closing */
+static void fd_evict_locked(vector<int> &closing)
+{
+    long time = now_ms();
+
+    while(!fd_idle.empty()){
+        struct fd_entry *e = fd_idle.front();
+        if(fd_count <= gdtnfs_conf.fd_max && time - e->idle_since <= FD_IDLE_MS){
+            break;
+        }
+        fd_idle.pop_front();
+        fd_unpool_locked(e);
+        closing.push_back(e->fd);
+        fd_count--;
+        fd_evicted++;
+        delete e;
+    }
+}
+
+
+static void fd_close_all(const vector<int> &closing)
+{
+    for(size_t i = 0; i < closing.size(); i++){
+        close(closing[i]);
+    }
+}
+
+
+/* an fd for fpath opened with flags; NULL and errno set on failure */
+static struct fd_entry *fd_get(const char *fpath, int flags, mode_t mode)
+{
+    /* these have to reach the NAS; the fd they give can be shared after */
+    int readonly = (flags & O_ACCMODE) == O_RDONLY;
+    int shareable = readonly && !(flags & (O_CREAT | O_EXCL | O_TRUNC));
+    int key = flags & ~(O_CREAT | O_EXCL | O_TRUNC | O_NOCTTY);
+    vector<int> closing;
+
+    pthread_mutex_lock(&fd_mutex);
+    fd_evict_locked(closing);
+    auto itr = fd_pool.find(fpath);
+    if(shareable && itr != fd_pool.end()){
+        vector<fd_entry *> &v = itr->second;
+        for(size_t i = 0; i < v.size(); i++){
+            struct fd_entry *e = v[i];
+            if(e->flags != key){
+                continue;
+            }
+            if(e->refs == 0){
+                fd_idle.erase(e->lru);
+                fd_warm++;
+            }else{
+                fd_shared++;
+            }
+            e->refs++;
+            pthread_mutex_unlock(&fd_mutex);
+            fd_close_all(closing);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&fd_mutex);
+    fd_close_all(closing);
+
+    int fd = nas_open(fpath, flags, mode);
+    if(fd == -1){
+        return NULL;
+    }
+
+    struct fd_entry *e = new fd_entry();
+    e->fpath = fpath;
+    e->flags = key;
+    e->fd = fd;
+    e->refs = 1;
+    e->pooled = readonly;
+    e->idle_since = 0;
+
+    pthread_mutex_lock(&fd_mutex);
+    fd_opens++;
+    fd_count++;
+    if(!e->pooled){
+        pthread_mutex_unlock(&fd_mutex);
+        return e;
+    }
+    vector<fd_entry *> &v = fd_pool[e->fpath];
+    for(size_t i = 0; i < v.size(); i++){
+        /* lost a race with another open, or truncated: keep private */
+        if(v[i]->flags == key){
+            e->pooled = 0;
+            break;
+        }
+    }
+    if(e->pooled){
+        v.push_back(e);
+    }else if(v.empty()){
+        fd_pool.erase(e->fpath);
+    }
+    pthread_mutex_unlock(&fd_mutex);
+
+    return e;
+}
+
+
+static void fd_put(struct fd_entry *e)
+{
+    vector<int> closing;
+
+    pthread_mutex_lock(&fd_mutex);
+    if(--e->refs == 0){
+        if(e->pooled){
+            e->idle_since = now_ms();
+            e->lru = fd_idle.insert(fd_idle.end(), e);
+        }else{
+            closing.push_back(e->fd);
+            fd_count--;
+            delete e;
+        }
+    }
+    fd_evict_locked(closing);
+    pthread_mutex_unlock(&fd_mutex);
+
+    fd_close_all(closing);
+}
+
+
+/* fpath was removed or renamed: no open may pick up its fds any more */
+static void fd_drop(const char *fpath)
+{
+    vector<int> closing;
+
+    pthread_mutex_lock(&fd_mutex);
+    auto itr = fd_pool.find(fpath);
+    if(itr != fd_pool.end()){
+        vector<fd_entry *> v = itr->second;
+        for(size_t i = 0; i < v.size(); i++){
+            struct fd_entry *e = v[i];
+            fd_unpool_locked(e);
+            if(e->refs == 0){
+                fd_idle.erase(e->lru);
+                closing.push_back(e->fd);
+                fd_count--;
+                delete e;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fd_mutex);
+
+    fd_close_all(closing);
+}
+
+
+static struct gdtnfs_file *new_file(struct fd_entry *e, const char *path, const char *fpath)
+{
+    struct gdtnfs_file *f = new gdtnfs_file();
+
+    f->fd = e->fd;
+    f->fde = e;
+    f->dfd = -1;
+    f->dfde = NULL;
+    f->path = path;
+    f->nas = fpath_nas(fpath);
+    pthread_mutex_init(&f->lock, NULL);
+    f->wbuf = NULL;
+    f->wbuf_len = 0;
+    f->wbuf_off = 0;
+    f->wbuf_time = 0;
+    f->wbuf_err = 0;
+
+    memset(f->ra, 0, sizeof(f->ra));
+    f->ra_next = 0;
+    f->ra_seq = 0;
+    f->ra_window = min((size_t)RA_MIN_WINDOW, (size_t)gdtnfs_conf.ra_max);
+    f->ra_pending = 0;
+    f->ra_pend_off = 0;
+    f->ra_pend_len = 0;
+    f->ra_gen = 0;
+    pthread_cond_init(&f->ra_cond, NULL);
+    f->ra_hits = 0;
+    f->ra_misses = 0;
+
+    pthread_mutex_lock(&files_mutex);
+    while(trimming.count(f->path)){
+        pthread_cond_wait(&trim_cond, &files_mutex);
+    }
+    f->wgen = write_gens[path].lock();
+    if(!f->wgen){
+        f->wgen = make_shared<atomic<unsigned long> >(0);
+        write_gens[path] = f->wgen;
+    }
+    f->ra_wgen = *f->wgen;
+    open_files.insert(f);
+    pthread_mutex_unlock(&files_mutex);
+
+    return f;
+}
+
+
+static void ra_free(struct ra_slot *slot);
+
+static void free_file(struct gdtnfs_file *f)
+{
+    pthread_mutex_lock(&files_mutex);
+    open_files.erase(f);
+    f->wgen.reset();
+    auto itr = write_gens.find(f->path);
+    if(itr != write_gens.end() && itr->second.expired()){
+        write_gens.erase(itr);
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    if(f->ra_hits + f->ra_misses > 0){
+        PRINT_INFO("readahead %s: %lu hits, %lu misses, window %zu",
+                   f->path.c_str(), f->ra_hits, f->ra_misses, f->ra_window);
+    }
+    ra_free(&f->ra[0]);
+    ra_free(&f->ra[1]);
+    pthread_cond_destroy(&f->ra_cond);
+    pthread_mutex_destroy(&f->lock);
+    free(f->wbuf);
+    delete f;
+}
+
+
+/* caller holds f->lock */
+static int wbuf_flush_locked(struct gdtnfs_file *f)
+{
+    size_t done = 0;
+
+    while(done < f->wbuf_len){
+        ssize_t res = pwrite(f->fd, f->wbuf + done, f->wbuf_len - done, f->wbuf_off + done);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            f->wbuf_err = errno;
+            PRINT_ERR("Error: pwrite(%s) %s", f->path.c_str(), strerror(errno));
+            break;
+        }
+        done += res;
+    }
+    if(done > 0){
+        (*f->wgen)++;
+    }
+    f->wbuf_len = 0;
+
+    return -f->wbuf_err;
+}
+
+
+/* flush the buffer and hand back a deferred write error once */
+static int wbuf_flush(struct gdtnfs_file *f)
+{
+    pthread_mutex_lock(&f->lock);
+    int res = wbuf_flush_locked(f);
+    f->wbuf_err = 0;
+    pthread_mutex_unlock(&f->lock);
+
+    return res;
+}
+
+
+/* flush for a stat, truncate or allocation on the handle; a write error
+ * stays deferred for flush, fsync or release to report */
+static void wbuf_flush_keep(struct gdtnfs_file *f)
+{
+    pthread_mutex_lock(&f->lock);
+    wbuf_flush_locked(f);
+    pthread_mutex_unlock(&f->lock);
+}
+
+
+/* flush every handle of path; the first write error is returned and, as
+ * with wbuf_flush_keep, also stays deferred on its handle */
+static int wbuf_flush_path(const char *path)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&files_mutex);
+    for(auto itr = open_files.begin(); itr != open_files.end(); ++itr){
+        struct gdtnfs_file *f = *itr;
+        if(f->path == path){
+            pthread_mutex_lock(&f->lock);
+            int err = wbuf_flush_locked(f);
+            pthread_mutex_unlock(&f->lock);
+            if(res == 0){
+                res = err;
+            }
+        }
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    return res;
+}
+
+
+static void ra_invalidate_locked(struct gdtnfs_file *f);
+
+static int wbuf_write(struct gdtnfs_file *f, const char *buf, size_t size, off_t offset)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&f->lock);
+    ra_invalidate_locked(f);
+    if(f->wbuf_err){
+        res = -f->wbuf_err;
+        f->wbuf_err = 0;
+        pthread_mutex_unlock(&f->lock);
+        return res;
+    }
+
+    /* only strictly appending writes are coalesced */
+    if(f->wbuf_len > 0 &&
+       (offset != f->wbuf_off + (off_t)f->wbuf_len ||
+        f->wbuf_len + size > gdtnfs_conf.wbuf_size)){
+        res = wbuf_flush_locked(f);
+        if(res != 0){
+            f->wbuf_err = 0;
+            pthread_mutex_unlock(&f->lock);
+            return res;
+        }
+    }
+
+    if(size >= gdtnfs_conf.wbuf_size){
+        res = pwrite(f->fd, buf, size, offset);
+        if(res == -1)
+            res = -errno;
+        pthread_mutex_unlock(&f->lock);
+        return res;
+    }
+
+    if(f->wbuf == NULL){
+        f->wbuf = (char *)malloc(gdtnfs_conf.wbuf_size);
+        if(f->wbuf == NULL){
+            pthread_mutex_unlock(&f->lock);
+            return -ENOMEM;
+        }
+    }
+    if(f->wbuf_len == 0){
+        f->wbuf_off = offset;
+        f->wbuf_time = now_ms();
+    }
+    memcpy(f->wbuf + f->wbuf_len, buf, size);
+    f->wbuf_len += size;
+    pthread_mutex_unlock(&f->lock);
+
+    return size;
+}
+
+
+/* a read must see data still sitting in the write buffer of any handle
+ * of the file, since write() already returned and attr_write already
+ * reports the new size */
+static void wbuf_flush_range(const string &path, size_t size, off_t offset)
+{
+    pthread_mutex_lock(&files_mutex);
+    for(auto itr = open_files.begin(); itr != open_files.end(); ++itr){
+        struct gdtnfs_file *f = *itr;
+        if(f->path != path){
+            continue;
+        }
+        pthread_mutex_lock(&f->lock);
+        if(f->wbuf_len > 0 &&
+           offset < f->wbuf_off + (off_t)f->wbuf_len &&
+           f->wbuf_off < offset + (off_t)size){
+            wbuf_flush_locked(f);
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    pthread_mutex_unlock(&files_mutex);
+}
+
+
+static void *wbuf_thread(void *ptr)
+{
+    int ret = pthread_detach(pthread_self());
+    if(ret != 0){
+        PRINT_ERR("Error: pthread_detach() of wbuf_thread %s\n", strerror(errno));
+    }
+
+    unsigned int interval = gdtnfs_conf.wbuf_delay / 2;
+    if(interval < 10){
+        interval = 10;
+    }
+
+    while(1){
+        usleep(interval * 1000);
+
+        long time = now_ms();
+        pthread_mutex_lock(&files_mutex);
+        for(auto itr = open_files.begin(); itr != open_files.end(); ++itr){
+            struct gdtnfs_file *f = *itr;
+            pthread_mutex_lock(&f->lock);
+            if(f->wbuf_len > 0 && time - f->wbuf_time >= gdtnfs_conf.wbuf_delay){
+                wbuf_flush_locked(f);
+            }
+            pthread_mutex_unlock(&f->lock);
+        }
+        pthread_mutex_unlock(&files_mutex);
+    }
+
+    return NULL;
+}
+
+
+static void start_wbuf_thread(void)
+{
+    pthread_t wbuf_th;
+    int ret = pthread_create(&wbuf_th, NULL, &wbuf_thread, NULL);
+    if(ret != 0){
+        fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void ra_release(char *buf, size_t cap)
+{
+    free(buf);
+    pthread_mutex_lock(&ra_mutex);
+    ra_pool_used -= cap;
+    pthread_mutex_unlock(&ra_mutex);
+}
+
+
+/* take a buffer out of the readahead pool, NULL when the pool is used up */
+static char *ra_alloc(size_t size)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&ra_mutex);
+    if(ra_pool_used + size <= gdtnfs_conf.ra_pool){
+        buf = (char *)malloc(size);
+        if(buf != NULL){
+            ra_pool_used += size;
+        }
+    }
+    pthread_mutex_unlock(&ra_mutex);
+
+    return buf;
+}
+
+
+static void ra_free(struct ra_slot *slot)
+{
+    if(slot->buf != NULL){
+        ra_release(slot->buf, slot->cap);
+    }
+    memset(slot, 0, sizeof(*slot));
+}
+
+
+/* caller holds f->lock */
+static void ra_invalidate_locked(struct gdtnfs_file *f)
+{
+    ra_free(&f->ra[0]);
+    ra_free(&f->ra[1]);
+    f->ra_gen++;
+}
+
+
+static void ra_invalidate_path(const char *path)
+{
+    pthread_mutex_lock(&files_mutex);
+    for(auto itr = open_files.begin(); itr != open_files.end(); ++itr){
+        struct gdtnfs_file *f = *itr;
+        if(f->path == path){
+            pthread_mutex_lock(&f->lock);
+            ra_invalidate_locked(f);
+            pthread_mutex_unlock(&f->lock);
+        }
+    }
+    pthread_mutex_unlock(&files_mutex);
+}
+
+
+/* data of path changed on the NAS; readahead of every handle notices
+ * in ra_copy_locked */
+static void ra_written(const char *path, struct fuse_file_info *fi)
+{
+    if(fi != NULL){
+        (*get_file(fi)->wgen)++;
+        return;
+    }
+
+    pthread_mutex_lock(&files_mutex);
+    auto itr = write_gens.find(path);
+    if(itr != write_gens.end()){
+        shared_ptr<atomic<unsigned long> > gen = itr->second.lock();
+        if(gen){
+            (*gen)++;
+        }
+    }
+    pthread_mutex_unlock(&files_mutex);
+}
+
+
+/* serve [offset, offset + size) from the slots, -1 unless fully covered */
+static ssize_t ra_copy_locked(struct gdtnfs_file *f, char *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    unsigned long wgen = *f->wgen;
+    if(wgen != f->ra_wgen){
+        ra_invalidate_locked(f);
+        f->ra_wgen = wgen;
+        return -1;
+    }
+
+    while(done < size){
+        off_t pos = offset + done;
+        struct ra_slot *slot = NULL;
+        for(int i = 0; i < 2; i++){
+            struct ra_slot *s = &f->ra[i];
+            if(s->buf != NULL && pos >= s->off && pos < s->off + (off_t)s->len){
+                slot = s;
+                break;
+            }
+        }
+        if(slot == NULL){
+            return -1;
+        }
+        size_t n = min(size - done, (size_t)(slot->off + (off_t)slot->len - pos));
+        memcpy(buf + done, slot->buf + (pos - slot->off), n);
+        done += n;
+    }
+
+    return done;
+}
+
+
+/* caller holds f->lock */
+static void ra_schedule_locked(struct gdtnfs_file *f)
+{
+    if(f->ra_pending || f->ra_window == 0){
+        return;
+    }
+
+    /* end of the data already buffered ahead of the reader */
+    off_t end = f->ra_next;
+    for(int n = 0; n < 2; n++){
+        for(int i = 0; i < 2; i++){
+            struct ra_slot *s = &f->ra[i];
+            if(s->buf != NULL && s->off <= end && s->off + (off_t)s->len > end){
+                end = s->off + s->len;
+            }
+        }
+    }
+    if(end - f->ra_next >= (off_t)f->ra_window / 2){
+        return;
+    }
+
+    f->ra_pending = 1;
+    f->ra_pend_off = end;
+    f->ra_pend_len = f->ra_window;
+    posix_fadvise(f->fd, f->ra_pend_off, f->ra_pend_len, POSIX_FADV_WILLNEED);
+
+    /* keep growing the window while the stream stays sequential */
+    f->ra_window = min(f->ra_window * 2, (size_t)gdtnfs_conf.ra_max);
+
+    pthread_mutex_lock(&ra_mutex);
+    ra_queue.push_back(f);
+    pthread_cond_signal(&ra_queue_cond);
+    pthread_mutex_unlock(&ra_mutex);
+}
+
+
+static int ra_read(struct gdtnfs_file *f, char *buf, size_t size, off_t offset)
+{
+    int res;
+
+    pthread_mutex_lock(&f->lock);
+    while(f->ra_pending && offset >= f->ra_pend_off &&
+          offset < f->ra_pend_off + (off_t)f->ra_pend_len){
+        pthread_cond_wait(&f->ra_cond, &f->lock);
+    }
+
+    if(offset == f->ra_next){
+        f->ra_seq++;
+    }else{
+        f->ra_seq = 0;
+        if(f->ra_window > 0){
+            f->ra_window = min((size_t)RA_MIN_WINDOW, (size_t)gdtnfs_conf.ra_max);
+        }
+    }
+    f->ra_next = offset + size;
+
+    res = ra_copy_locked(f, buf, size, offset);
+    if(res >= 0){
+        f->ra_hits++;
+    }else{
+        f->ra_misses++;
+        pthread_mutex_unlock(&f->lock);
+        res = pread(f->fd, buf, size, offset);
+        if(res == -1)
+            res = -errno;
+        pthread_mutex_lock(&f->lock);
+    }
+
+    if(f->ra_seq > 0){
+        ra_schedule_locked(f);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    return res;
+}
+
+
+/* wait for an in-flight readahead before the handle goes away */
+static void ra_wait(struct gdtnfs_file *f)
+{
+    pthread_mutex_lock(&f->lock);
+    while(f->ra_pending){
+        pthread_cond_wait(&f->ra_cond, &f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+
+static void *ra_thread(void *ptr)
+{
+    int ret = pthread_detach(pthread_self());
+    if(ret != 0){
+        PRINT_ERR("Error: pthread_detach() of ra_thread %s\n", strerror(errno));
+    }
+
+    while(1){
+        pthread_mutex_lock(&ra_mutex);
+        while(ra_queue.empty()){
+            pthread_cond_wait(&ra_queue_cond, &ra_mutex);
+        }
+        struct gdtnfs_file *f = ra_queue.front();
+        ra_queue.pop_front();
+        pthread_mutex_unlock(&ra_mutex);
+
+        pthread_mutex_lock(&f->lock);
+        off_t off = f->ra_pend_off;
+        size_t len = f->ra_pend_len;
+        unsigned long gen = f->ra_gen;
+        unsigned long wgen = *f->wgen;
+        int fd = f->fd;
+        pthread_mutex_unlock(&f->lock);
+
+        ssize_t res = -1;
+        char *buf = ra_alloc(len);
+        if(buf != NULL){
+            res = pread(fd, buf, len, off);
+        }
+
+        pthread_mutex_lock(&f->lock);
+        if(res == -1 && buf != NULL){
+            /* e.g. a write-only handle */
+            f->ra_window = 0;
+        }
+        if(res > 0 && gen == f->ra_gen && wgen == *f->wgen){
+            if(wgen != f->ra_wgen){
+                ra_invalidate_locked(f);
+                f->ra_wgen = wgen;
+            }
+            /* replace the slot the reader has already left behind */
+            struct ra_slot *slot = &f->ra[0];
+            if(f->ra[0].buf != NULL &&
+               (f->ra[1].buf == NULL || f->ra[1].off < f->ra[0].off)){
+                slot = &f->ra[1];
+            }
+            ra_free(slot);
+            slot->buf = buf;
+            slot->off = off;
+            slot->len = res;
+            slot->cap = len;
+            buf = NULL;
+        }
+        f->ra_pending = 0;
+        pthread_cond_broadcast(&f->ra_cond);
+        pthread_mutex_unlock(&f->lock);
+
+        if(buf != NULL){
+            ra_release(buf, len);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void start_ra_threads(void)
+{
+    for(int i = 0; i < RA_THREADS; i++){
+        pthread_t ra_th;
+        int ret = pthread_create(&ra_th, NULL, &ra_thread, NULL);
+        if(ret != 0){
+            fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/*
+ * Direct I/O of direct_io files. The backend fd is opened with O_DIRECT,
+ * which needs memory, offset and length aligned; FUSE buffers are not,
+ * so data is bounced through aligned buffers kept in a small pool.
+ * Reads widen to the enclosing aligned range. A write not aligned in
+ * offset or length reads the partial blocks at its ends first and writes
+ * them back whole, under f->lock so two writes to one block do not undo
+ * each other. Only the part past the last whole block of the file goes
+ * through the buffered fd, since a whole block written there would
+ * extend the file to the block end.
+ */
+#define DIO_ALIGN 4096
+#define DIO_BUF_SIZE (2 * 1024 * 1024)
+#define DIO_POOL_MAX 16
+
+static vector<char *> dio_pool;
+static size_t dio_bufs;
+static unsigned long dio_reads;
+static unsigned long dio_writes;
+static unsigned long dio_unaligned;
+static pthread_mutex_t dio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static char *dio_alloc(void)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&dio_mutex);
+    if(!dio_pool.empty()){
+        buf = dio_pool.back();
+        dio_pool.pop_back();
+    }
+    pthread_mutex_unlock(&dio_mutex);
+
+    if(buf == NULL){
+        if(posix_memalign((void **)&buf, DIO_ALIGN, DIO_BUF_SIZE) != 0){
+            return NULL;
+        }
+        pthread_mutex_lock(&dio_mutex);
+        dio_bufs++;
+        pthread_mutex_unlock(&dio_mutex);
+    }
+    return buf;
+}
+
+
+static void dio_release(char *buf)
+{
+    pthread_mutex_lock(&dio_mutex);
+    if(dio_pool.size() < DIO_POOL_MAX){
+        dio_pool.push_back(buf);
+        buf = NULL;
+    }else{
+        dio_bufs--;
+    }
+    pthread_mutex_unlock(&dio_mutex);
+
+    free(buf);
+}
+
+
+static ssize_t dio_read(struct gdtnfs_file *f, char *buf, size_t size, off_t offset)
+{
+    char *abuf = dio_alloc();
+    if(abuf == NULL){
+        return -ENOMEM;
+    }
+
+    ssize_t done = 0;
+    while((size_t)done < size){
+        off_t pos = offset + done;
+        off_t start = pos & ~(off_t)(DIO_ALIGN - 1);
+        size_t skip = pos - start;
+        size_t want = min(size - done, (size_t)DIO_BUF_SIZE - skip);
+        size_t len = (skip + want + DIO_ALIGN - 1) & ~(size_t)(DIO_ALIGN - 1);
+
+        ssize_t n = pread(f->dfd, abuf, len, start);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(done == 0){
+                done = -errno;
+            }
+            break;
+        }
+        if((size_t)n <= skip){
+            break;
+        }
+        size_t got = min(want, (size_t)n - skip);
+        memcpy(buf + done, abuf + skip, got);
+        done += got;
+        if(got < want){
+            break;
+        }
+    }
+    dio_release(abuf);
+
+    pthread_mutex_lock(&dio_mutex);
+    dio_reads++;
+    pthread_mutex_unlock(&dio_mutex);
+    return done;
+}
+
+
+/* one aligned block at start read into block, zeroes past EOF */
+static int dio_fill(struct gdtnfs_file *f, char *block, off_t start)
+{
+    ssize_t n;
+
+    do{
+        n = pread(f->dfd, block, DIO_ALIGN, start);
+    }while(n == -1 && errno == EINTR);
+    if(n == -1){
+        return -errno;
+    }
+    memset(block + n, 0, DIO_ALIGN - n);
+    return 0;
+}
+
+
+/* caller holds f->lock */
+static ssize_t dio_write_locked(struct gdtnfs_file *f, char *abuf, const char *buf,
+                                size_t size, off_t offset)
+{
+    ssize_t done = 0;
+    while((size_t)done < size){
+        off_t pos = offset + done;
+        off_t start = pos & ~(off_t)(DIO_ALIGN - 1);
+        size_t skip = pos - start;
+        size_t want = min(size - done, (size_t)DIO_BUF_SIZE - skip);
+        size_t len = (skip + want + DIO_ALIGN - 1) & ~(size_t)(DIO_ALIGN - 1);
+
+        int res = 0;
+        if(skip > 0){
+            res = dio_fill(f, abuf, start);
+        }
+        if(res == 0 && skip + want < len && (skip == 0 || len > DIO_ALIGN)){
+            res = dio_fill(f, abuf + len - DIO_ALIGN, start + len - DIO_ALIGN);
+        }
+        if(res != 0){
+            if(done == 0){
+                done = res;
+            }
+            break;
+        }
+        memcpy(abuf + skip, buf + done, want);
+
+        ssize_t n = pwrite(f->dfd, abuf, len, start);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(done == 0){
+                done = -errno;
+            }
+            break;
+        }
+        if((size_t)n <= skip){
+            break;
+        }
+        size_t put = min(want, (size_t)n - skip);
+        done += put;
+        if(put < want){
+            break;
+        }
+    }
+
+    return done;
+}
+
+
+static ssize_t dio_write(struct gdtnfs_file *f, const char *buf, size_t size, off_t offset)
+{
+    struct stat st;
+    off_t end = offset + size;
+    off_t tail = end;
+
+    char *abuf = dio_alloc();
+    if(abuf == NULL){
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    if(end & (DIO_ALIGN - 1)){
+        if(fstat(f->dfd, &st) == -1){
+            int err = errno;
+            pthread_mutex_unlock(&f->lock);
+            dio_release(abuf);
+            return -err;
+        }
+        tail = max(offset, min(end, max(end, st.st_size) & ~(off_t)(DIO_ALIGN - 1)));
+    }
+
+    ssize_t done = 0;
+    if(tail > offset){
+        done = dio_write_locked(f, abuf, buf, tail - offset, offset);
+    }
+    if(done == -EBADF){
+        /* a write-only O_DIRECT fd cannot read the partial blocks */
+        done = 0;
+        tail = offset;
+    }
+    if(done == tail - offset && tail < end){
+        ssize_t n = pwrite(f->fd, buf + done, end - tail, tail);
+        if(n == -1 && done == 0){
+            done = -errno;
+        }else if(n > 0){
+            done += n;
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+    dio_release(abuf);
+
+    pthread_mutex_lock(&dio_mutex);
+    dio_writes++;
+    if((offset | size) & (DIO_ALIGN - 1)){
+        dio_unaligned++;
+    }
+    pthread_mutex_unlock(&dio_mutex);
+    return done;
+}
+
+
+/* the O_DIRECT fd next to the buffered one; without it, when the NAS
+ * refuses O_DIRECT, the file is served buffered. A write-only open gets
+ * a read-write fd where it can, unaligned writes read their end blocks */
+static void dio_open(struct gdtnfs_file *f, const char *fpath, int flags)
+{
+    struct fd_entry *e = NULL;
+
+    flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
+    if((flags & O_ACCMODE) == O_WRONLY){
+        e = fd_get(fpath, (flags & ~O_ACCMODE) | O_RDWR | O_DIRECT, 0);
+    }
+    if(e == NULL){
+        e = fd_get(fpath, flags | O_DIRECT, 0);
+    }
+    if(e == NULL){
+        PRINT_ERR("Error: open(%s, O_DIRECT) %s", fpath, strerror(errno));
+        return;
+    }
+    f->dfde = e;
+    f->dfd = e->fd;
+}
+
+
+/* fsync requests queued for one NAS while its leader is flushing */
+struct commit_batch {
+    vector<int> fds;
+    vector<int> datasync;
+    vector<int> res;
+    int done;
+};
+
+struct commit_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    shared_ptr<commit_batch> pending;
+};
+
+static unordered_map<string, commit_group *> commit_groups;
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static commit_group *get_commit_group(const string &nas)
+{
+    pthread_mutex_lock(&commit_mutex);
+    commit_group *g = commit_groups[nas];
+    if(g == NULL){
+        g = new commit_group();
+        pthread_mutex_init(&g->lock, NULL);
+        pthread_cond_init(&g->cond, NULL);
+        g->running = 0;
+        commit_groups[nas] = g;
+    }
+    pthread_mutex_unlock(&commit_mutex);
+
+    return g;
+}
+
+
+static void commit_batch_sync(commit_batch *b)
+{
+    size_t size = b->fds.size();
+    int res_syncfs = 0;
+
+    /* with fsync_window set, one syncfs writes back and commits every
+     * file of the NAS, after which the per-file calls are cheap and only
+     * collect errors. It also flushes files nobody asked to sync, so
+     * it is only done when batching was asked for */
+    if(size > 1 && gdtnfs_conf.fsync_window > 0 && syncfs(b->fds[0]) == -1){
+        res_syncfs = -errno;
+        PRINT_ERR("Error: syncfs() %s", strerror(errno));
+    }
+
+    for(size_t i = 0; i < size; i++){
+        int res = b->datasync[i] ? fdatasync(b->fds[i]) : fsync(b->fds[i]);
+        b->res[i] = (res == -1) ? -errno : res_syncfs;
+    }
+    PRINT("group commit: %zu files", size);
+}
+
+
+static int group_fsync(const string &nas, int fd, int datasync)
+{
+    commit_group *g = get_commit_group(nas);
+
+    pthread_mutex_lock(&g->lock);
+    if(!g->pending){
+        g->pending = make_shared<commit_batch>();
+        g->pending->done = 0;
+    }
+    shared_ptr<commit_batch> b = g->pending;
+    size_t idx = b->fds.size();
+    b->fds.push_back(fd);
+    b->datasync.push_back(datasync);
+    b->res.push_back(0);
+
+    if(g->running){
+        while(!b->done){
+            pthread_cond_wait(&g->cond, &g->lock);
+        }
+        int res = b->res[idx];
+        pthread_mutex_unlock(&g->lock);
+        return res;
+    }
+
+    /* become the leader and flush batches until nobody is waiting */
+    g->running = 1;
+    if(gdtnfs_conf.fsync_window > 0){
+        pthread_mutex_unlock(&g->lock);
+        usleep(gdtnfs_conf.fsync_window);
+        pthread_mutex_lock(&g->lock);
+    }
+    while(g->pending){
+        shared_ptr<commit_batch> cur = g->pending;
+        g->pending.reset();
+        pthread_mutex_unlock(&g->lock);
+
+        commit_batch_sync(cur.get());
+
+        pthread_mutex_lock(&g->lock);
+        cur->done = 1;
+        pthread_cond_broadcast(&g->cond);
+    }
+    g->running = 0;
+    int res = b->res[idx];
+    pthread_mutex_unlock(&g->lock);
+
+    return res;
+}
+
+
+/* last day (days since the epoch) each sensor type was accessed on */
+static unordered_map<string, long> last_day;
+static unordered_set<string> prefetched_days;
+static deque<string> prefetch_queue;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+
+/* "/acc/2019/09/10[/...]" -> sensor "acc" and its day number, -1 otherwise */
+static long parse_day(const char *path, string &sensor)
+{
+    char name[NAME_MAX + 1] = {0};
+    char year[5] = {0}, mon[3] = {0}, mday[3] = {0};
+    int n = 0;
+
+    if(sscanf(path, "/%255[^/]/%4[0-9]/%2[0-9]/%2[0-9]%n", name, year, mon, mday, &n) != 4 ||
+       n == 0 || (path[n] != '\0' && path[n] != '/')){
+        return -1;
+    }
+
+    struct tm tm = {0};
+    tm.tm_year = atoi(year) - 1900;
+    tm.tm_mon = atoi(mon) - 1;
+    tm.tm_mday = atoi(mday);
+    if(tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 || tm.tm_mday > 31){
+        return -1;
+    }
+
+    sensor = name;
+    return timegm(&tm) / 86400;
+}
+
+
+static string day_path(const string &sensor, long day)
+{
+    char buf[PATH_MAX] = {0};
+    time_t t = day * 86400;
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    snprintf(buf, sizeof(buf), "/%s/%04d/%02d/%02d", sensor.c_str(),
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+
+    return buf;
+}
+
+
+/* queue the following days once a sensor is scanned day after day */
+static void day_access(const char *path)
+{
+    string sensor;
+
+    if(gdtnfs_conf.day_prefetch == 0){
+        return;
+    }
+    long day = parse_day(path, sensor);
+    if(day < 0){
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_mutex);
+    auto itr = last_day.find(sensor);
+    if(itr == last_day.end() || itr->second != day){
+        bool sequential = (itr != last_day.end() && itr->second + 1 == day);
+        last_day[sensor] = day;
+        if(sequential){
+            if(prefetched_days.size() > 4096){
+                prefetched_days.clear();
+            }
+            for(unsigned int i = 1; i <= gdtnfs_conf.day_prefetch; i++){
+                string next = day_path(sensor, day + i);
+                if(prefetched_days.insert(next).second){
+                    prefetch_queue.push_back(next);
+                }
+            }
+            pthread_cond_signal(&prefetch_cond);
+        }
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+
+/* warm listing, location cache and file heads of one day directory */
+static void prefetch_day(const string &path)
+{
+    char fpath[PATH_MAX] = {0};
+    vector<string> dirs;
+    unordered_set<string> seen;
+    int nfiles = 0;
+
+    if(gdtnfs_fullpath_process(fpath, path.c_str()) == 0){
+        return;
+    }
+    PRINT("prefetch %s", path.c_str());
+
+    list_dirs(path.c_str(), dirs);
+
+    for(size_t i = 0; i < dirs.size(); i++){
+        string dir = dirs[i] + path;
+        DIR *dp = nas_opendir(dir.c_str());
+        if(dp == NULL){
+            continue;
+        }
+
+        struct dirent *de;
+        while((de = readdir(dp)) != NULL){
+            if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0){
+                continue;
+            }
+            if(!seen.insert(de->d_name).second){
+                continue;
+            }
+            loc_set(path + "/" + de->d_name, dirs[i]);
+
+            if(de->d_type == DT_REG && nfiles < PREFETCH_MAX_FILES){
+                string file = dir + "/" + de->d_name;
+                int fd = nas_open(file.c_str(), O_RDONLY | O_NONBLOCK, 0);
+                if(fd != -1){
+                    posix_fadvise(fd, 0, PREFETCH_HEAD, POSIX_FADV_WILLNEED);
+                    close(fd);
+                }
+                nfiles++;
+            }
+        }
+        closedir(dp);
+    }
+}
+
+
+static void *prefetch_thread(void *ptr)
+{
+    int ret = pthread_detach(pthread_self());
+    if(ret != 0){
+        PRINT_ERR("Error: pthread_detach() of prefetch_thread %s\n", strerror(errno));
+    }
+
+    while(1){
+        pthread_mutex_lock(&prefetch_mutex);
+        while(prefetch_queue.empty()){
+            pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+        }
+        string path = prefetch_queue.front();
+        prefetch_queue.pop_front();
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        prefetch_day(path);
+    }
+
+    return NULL;
+}
+
+
+static void start_prefetch_thread(void)
+{
+    pthread_t prefetch_th;
+    int ret = pthread_create(&prefetch_th, NULL, &prefetch_thread, NULL);
+    if(ret != 0){
+        fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/* policy of the first cache line matching path; all zero when none does */
+static cache_policy_t find_cache_policy(const char *path)
+{
+    cache_policy_t policy = {"", 0, 0, 0, 0, 0};
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    size_t size = cache_policies.size();
+    for (unsigned int i = 0; i < size; i++) {
+        const char *pattern = cache_policies[i].pattern.c_str();
+        if(fnmatch(pattern, path, FNM_PATHNAME | FNM_LEADING_DIR) == 0){
+            policy = cache_policies[i];
+            break;
+        }
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    return policy;
+}
+
+
+/*
+ * With prune, data a rule put on another NAS is only found through the
+ * spill record. Data spilled before the record existed, or placed under
+ * an earlier version of an edited rule, is found again by looking for
+ * each rule's subtree on the other NAS. Done at startup and whenever the
+ * rules change; the globs run without mutex.
+ */
+static void spill_scan(void)
+{
+    static vector<pattern_t> scanned;
+    vector<pattern_t> patterns;
+    vector<string> dirs;
+
+    if(!gdtnfs_conf.prune){
+        return;
+    }
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    patterns = target_patterns;
+    for(size_t i = 0; i < target_dirs.size(); i++){
+        dirs.push_back(target_dirs[i].name);
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    bool changed = (patterns.size() != scanned.size());
+    for(size_t i = 0; !changed && i < patterns.size(); i++){
+        changed = (patterns[i].pattern != scanned[i].pattern ||
+                   patterns[i].path != scanned[i].path);
+    }
+    if(!changed){
+        return;
+    }
+
+    for(size_t i = 0; i < patterns.size(); i++){
+        for(size_t j = 0; j < dirs.size(); j++){
+            if(dirs[j] == patterns[i].path){
+                continue;
+            }
+            glob_t g;
+            string pattern = dirs[j] + patterns[i].pattern;
+            bool found = (glob(pattern.c_str(), GLOB_NOSORT, NULL, &g) == 0 && g.gl_pathc > 0);
+            globfree(&g);
+            if(!found){
+                continue;
+            }
+#if USE_LOCK
+            pthread_mutex_lock(&mutex);
+#endif
+            record_spill_locked(patterns[i].pattern, dirs[j]);
+#if USE_LOCK
+            pthread_mutex_unlock(&mutex);
+#endif
+        }
+    }
+    scanned = patterns;
+}
+
+
+static void *config_thread(void *ptr)
+{
+    int ret = pthread_detach(pthread_self());
+    if(ret != 0){
+        PRINT_ERR("Error: pthread_detach() %s\n", strerror(errno));
+    }
+
+    while(1){
+        read_config();
+        spill_scan();
+		sleep(interval_conf);
+    }
+
+    return NULL;
+}
+
+
+static void start_config_thread(void)
+{
+    pthread_t th;
+    int ret = pthread_create(&th, NULL, &config_thread, NULL);
+    if(ret != 0){
+        fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool delete_ump(string file_pass)
+{
+  auto itr = ump.find(file_pass);
+  if (itr != ump.end())
+	{
+	  ump.erase(itr);
+	  return true;
+	}
+  else
+	{
+	  return false;
+	}
+}
+
+
+static void organize_ump(unsigned int memory_span)
+{
+    auto time_now = chrono::system_clock::now();
+	auto time_ms = chrono::time_point_cast<chrono::milliseconds>(time_now);
+	long time = time_ms.time_since_epoch().count();
+	vector<string> vec_erase;
+
+	for (auto itr = ump.begin(); itr != ump.end(); itr++)
+	{
+  	    if(time - itr->second > memory_span)
+		{
+		    vec_erase.push_back(itr->first);
+		}
+	}
+
+	for(auto itr = vec_erase.begin(); itr != vec_erase.end(); ++itr)
+	{
+	  	PRINT(" ** delete ncache %s", *itr);
+	    delete_ump(*itr);
+	}
+	
+	return;
+}
+
+
+static void organize_loc(unsigned int memory_span)
+{
+    long time = now_ms();
+
+    for(auto itr = loc_cache.begin(); itr != loc_cache.end(); ){
+        if(time - itr->second.time > memory_span){
+            itr = loc_cache.erase(itr);
+        }else{
+            ++itr;
+        }
+    }
+}
+
+
+static void *ncache_thread(void *ptr)
+{
+    int ret = pthread_detach(pthread_self());
+    if(ret != 0){
+        PRINT_ERR("Error: pthread_detach() of ncache_thread %s\n", strerror(errno));
+    }
+	
+	unsigned int *interval = &ncache_lifetime;
+	unsigned int memory_span = (*interval) * 1000;
+
+	PRINT(" ncache interval : %d", *interval);
+	
+	while(1) {
+	    sleep(*interval);
+#if USE_LOCK
+        pthread_mutex_lock(&mutex);
+#endif
+		organize_ump(memory_span);
+        organize_loc(memory_span);
+        organize_known(memory_span);
+#if USE_LOCK
+        pthread_mutex_unlock(&mutex);
+#endif
+        print_stats();
+	}
+}
+
+static void start_ncache_thread(void)
+{
+    pthread_t ncache_th;
+    unsigned int ncache_interval = ncache_lifetime;
+	PRINT("ncache lifetime : %d", ncache_lifetime);
+    int ret = pthread_create(&ncache_th, NULL, &ncache_thread, &ncache_interval);
+    if(ret != 0) {
+  	    fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* newest day each sensor type created files in, and when */
+struct skel_t {
+    long day;
+    long time;
+};
+static unordered_map<string, skel_t> skel_sensors;
+static unordered_set<string> skel_done;
+static pthread_mutex_t skel_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define SKEL_RECENT (2 * 86400 * 1000L)
+
+static int gdtnfs_mkdir(const char *path, mode_t mode);
+
+
+static void day_written(const char *path)
+{
+    string sensor;
+
+    if(gdtnfs_conf.skel_days == 0){
+        return;
+    }
+    long day = parse_day(path, sensor);
+    if(day < 0){
+        return;
+    }
+
+    pthread_mutex_lock(&skel_mutex);
+    skel_t &skel = skel_sensors[sensor];
+    if(day >= skel.day){
+        skel.day = day;
+        skel.time = now_ms();
+    }
+    pthread_mutex_unlock(&skel_mutex);
+}
+
+
+/*
+ * Every sensor stream starts a new day directory at midnight at once.
+ * Create the next skel_days directories of each sensor that wrote in
+ * the last two days ahead of time, through the routing rules as a
+ * create would, which also leaves them in the location and known
+ * directory caches.
+ */
+static void *skel_thread(void *ptr)
+{
+    int ret = pthread_detach(pthread_self());
+    if(ret != 0){
+        PRINT_ERR("Error: pthread_detach() of skel_thread %s\n", strerror(errno));
+    }
+
+    while(1){
+        vector<string> paths;
+        long time = now_ms();
+
+        pthread_mutex_lock(&skel_mutex);
+        if(skel_done.size() > 4096){
+            skel_done.clear();
+        }
+        for(auto itr = skel_sensors.begin(); itr != skel_sensors.end(); ){
+            if(time - itr->second.time > SKEL_RECENT){
+                itr = skel_sensors.erase(itr);
+                continue;
+            }
+            for(unsigned int i = 1; i <= gdtnfs_conf.skel_days; i++){
+                string path = day_path(itr->first, itr->second.day + i);
+                if(skel_done.count(path) == 0){
+                    paths.push_back(path);
+                }
+            }
+            ++itr;
+        }
+        pthread_mutex_unlock(&skel_mutex);
+
+        /* a path is only done once it exists, so a failed mkdir (NAS
+         * down or full) is tried again in the next round */
+        for(size_t i = 0; i < paths.size(); i++){
+            char fpath[PATH_MAX] = {0};
+            if(gdtnfs_fullpath_process(fpath, paths[i].c_str()) == 0){
+                int res = gdtnfs_mkdir(paths[i].c_str(), 0777 & ~default_umask);
+                if(res != 0 && res != -EEXIST){
+                    PRINT_ERR("Error: skel mkdir(%s) %s", paths[i].c_str(), strerror(-res));
+                    continue;
+                }
+                PRINT_INFO("skel: %s", paths[i].c_str());
+            }
+            pthread_mutex_lock(&skel_mutex);
+            skel_done.insert(paths[i]);
+            pthread_mutex_unlock(&skel_mutex);
+        }
+
+        sleep(interval_conf);
+    }
+
+    return NULL;
+}
+
+
+static void start_skel_thread(void)
+{
+    pthread_t skel_th;
+    int ret = pthread_create(&skel_th, NULL, &skel_thread, NULL);
+    if(ret != 0){
+        fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Inode table for the low-level API. The kernel refers to files by
+ * the numbers handed out here; each inode knows its parent and name,
+ * so a lookup only appends one component to its parent's path, and
+ * it remembers the NAS it was found on and its last attributes.
+ */
+struct gdtnfs_inode {
+    fuse_ino_t ino;
+    fuse_ino_t parent;
+    string name;
+    string nas;
+    uint64_t nlookup;
+    int linked;          /* still reachable as parent/name */
+    struct stat st;      /* as of the last reply */
+};
+
+struct inode_key {
+    fuse_ino_t parent;
+    string name;
+
+    bool operator==(const inode_key& right) const {
+        return parent == right.parent && name == right.name;
+    }
+};
+
+struct inode_key_hash {
+    size_t operator()(const inode_key& key) const {
+        return hash<string>()(key.name) ^ (key.parent * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+static pthread_mutex_t inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<fuse_ino_t, gdtnfs_inode *> inodes;
+static unordered_map<inode_key, gdtnfs_inode *, inode_key_hash> inode_names;
+static fuse_ino_t inode_next = FUSE_ROOT_ID + 1;
+
+
+static void inode_init(void)
+{
+    struct gdtnfs_inode *root = new gdtnfs_inode();
+    root->ino = FUSE_ROOT_ID;
+    root->parent = 0;
+    root->nlookup = 1;
+    root->linked = 1;
+    memset(&root->st, 0, sizeof(root->st));
+    inodes[FUSE_ROOT_ID] = root;
+}
+
+
+/* SDFS path of ino; -ENOENT once it or a parent was unlinked */
+static int inode_path(fuse_ino_t ino, string &path)
+{
+    vector<const string *> names;
+    int res = 0;
+
+    pthread_mutex_lock(&inode_mutex);
+    while(ino != FUSE_ROOT_ID){
+        auto itr = inodes.find(ino);
+        if(itr == inodes.end() || !itr->second->linked){
+            res = -ENOENT;
+            break;
+        }
+        names.push_back(&itr->second->name);
+        ino = itr->second->parent;
+    }
+    if(res == 0){
+        path.clear();
+        for(size_t i = names.size(); i-- > 0; ){
+            path += "/";
+            path += *names[i];
+        }
+        if(path.empty()){
+            path = "/";
+        }
+    }
+    pthread_mutex_unlock(&inode_mutex);
+
+    return res;
+}
+
+
+static int inode_child_path(fuse_ino_t parent, const char *name, string &path)
+{
+    int res = inode_path(parent, path);
+    if(res != 0){
+        return res;
+    }
+    if(path != "/"){
+        path += "/";
+    }
+    path += name;
+
+    return (path.size() >= PATH_MAX) ? -ENAMETOOLONG : 0;
+}
+
+
+/* NAS the child was last found on, "" when unknown */
+static string inode_child_nas(fuse_ino_t parent, const char *name)
+{
+    string nas;
+    inode_key key = {parent, name};
+
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inode_names.find(key);
+    if(itr != inode_names.end()){
+        nas = itr->second->nas;
+    }
+    pthread_mutex_unlock(&inode_mutex);
+
+    return nas;
+}
+
+
+/* take one lookup reference on parent/name, creating its inode */
+static fuse_ino_t inode_ref(fuse_ino_t parent, const char *name,
+                            const string &nas, const struct stat *st)
+{
+    inode_key key = {parent, name};
+    struct gdtnfs_inode *node;
+
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inode_names.find(key);
+    if(itr != inode_names.end()){
+        node = itr->second;
+    }else{
+        node = new gdtnfs_inode();
+        node->ino = inode_next++;
+        node->parent = parent;
+        node->name = name;
+        node->nlookup = 0;
+        node->linked = 1;
+        inodes[node->ino] = node;
+        inode_names[key] = node;
+    }
+    node->nlookup++;
+    if(!nas.empty()){
+        node->nas = nas;
+    }
+    node->st = *st;
+    fuse_ino_t ino = node->ino;
+    pthread_mutex_unlock(&inode_mutex);
+
+    return ino;
+}
+
+
+static void inode_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inodes.find(ino);
+    if(itr != inodes.end() && ino != FUSE_ROOT_ID){
+        struct gdtnfs_inode *node = itr->second;
+        node->nlookup -= min(nlookup, node->nlookup);
+        if(node->nlookup == 0){
+            if(node->linked){
+                inode_key key = {node->parent, node->name};
+                inode_names.erase(key);
+            }
+            inodes.erase(itr);
+            delete node;
+        }
+    }
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+
+/* caller holds inode_mutex */
+static void inode_unlink_locked(fuse_ino_t parent, const string &name)
+{
+    inode_key key = {parent, name};
+    auto itr = inode_names.find(key);
+    if(itr != inode_names.end()){
+        itr->second->linked = 0;
+        inode_names.erase(itr);
+    }
+}
+
+
+static void inode_unlink(fuse_ino_t parent, const char *name)
+{
+    pthread_mutex_lock(&inode_mutex);
+    inode_unlink_locked(parent, name);
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+
+static void inode_rename(fuse_ino_t parent, const char *name,
+                         fuse_ino_t newparent, const char *newname)
+{
+    inode_key key = {parent, name};
+
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inode_names.find(key);
+    if(itr != inode_names.end()){
+        struct gdtnfs_inode *node = itr->second;
+        inode_names.erase(itr);
+        inode_unlink_locked(newparent, newname);
+        node->parent = newparent;
+        node->name = newname;
+        inode_key newkey = {newparent, newname};
+        inode_names[newkey] = node;
+    }else{
+        inode_unlink_locked(newparent, newname);
+    }
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+
+static bool inode_attr(fuse_ino_t ino, struct stat *st)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inodes.find(ino);
+    if(itr != inodes.end()){
+        *st = itr->second->st;
+        found = true;
+    }
+    pthread_mutex_unlock(&inode_mutex);
+
+    return found;
+}
+
+
+static string inode_nas(fuse_ino_t ino)
+{
+    string nas;
+
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inodes.find(ino);
+    if(itr != inodes.end()){
+        nas = itr->second->nas;
+    }
+    pthread_mutex_unlock(&inode_mutex);
+
+    return nas;
+}
+
+
+static void inode_update(fuse_ino_t ino, const string &nas, const struct stat *st)
+{
+    pthread_mutex_lock(&inode_mutex);
+    auto itr = inodes.find(ino);
+    if(itr != inodes.end()){
+        if(!nas.empty()){
+            itr->second->nas = nas;
+        }
+        itr->second->st = *st;
+    }
+    pthread_mutex_unlock(&inode_mutex);
+}
+
+
+static void gdtnfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+
+    if(gdtnfs_conf.writeback){
+        if(conn->capable & FUSE_CAP_WRITEBACK_CACHE){
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        }else{
+            PRINT_ERR("Error: kernel does not support writeback cache");
+        }
+        conn->max_write = WRITEBACK_MAX_WRITE;
+        conn->max_read = WRITEBACK_MAX_WRITE;
+        conn->max_readahead = WRITEBACK_MAX_WRITE;
+#if FUSE_VERSION < FUSE_MAKE_VERSION(3, 6)
+        PRINT_ERR("Error: libfuse before 3.6 limits requests to 128KiB");
+#endif
+    }
+
+    start_config_thread();
+	start_ncache_thread();
+	PRINT("start_ncache_thread");
+    if(gdtnfs_conf.wbuf_size > 0 && gdtnfs_conf.wbuf_delay > 0){
+        start_wbuf_thread();
+    }
+    if(gdtnfs_conf.ra_max > 0){
+        start_ra_threads();
+    }
+    if(gdtnfs_conf.day_prefetch > 0){
+        start_prefetch_thread();
+    }
+    if(gdtnfs_conf.skel_days > 0){
+        start_skel_thread();
+    }
+}
+
+
+/* attributes of an open file; without a handle the ll ops use lookup_stat */
+static int gdtnfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    int res;
+
+    PRINT("call %s", path);
+    if(attr_get(path, stbuf))
+        return 0;
+
+    struct gdtnfs_file *f = get_file(fi);
+    wbuf_flush_keep(f);
+    res = fstat(f->fd, stbuf);
+    if (res == -1)
+        return -errno;
+    stbuf->st_ino = map_ino(f->nas, stbuf->st_ino);
+
+    attr_put(path, stbuf);
+    return 0;
+}
+
+
+static int gdtnfs_access(const char *path, int mask)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    res = faccessat(dirfd, rel, mask, 0);
+    if (res == -1)
+        return -errno;
+
+    return 0;
+}
+
+
+static int gdtnfs_readlink(const char *path, char *buf, size_t size)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    res = readlinkat(dirfd, rel, buf, size - 1);
+    if (res == -1)
+        return -errno;
+
+    buf[res] = '\0';
+    return 0;
+}
+
+
+struct list_entry {
+    string name;
+    ino_t ino;
+    unsigned char type;
+    int nas;
+    int has_st;
+    int deleted;
+    struct stat st;
+};
+
+/* listing of one directory on one NAS, filled by list_thread */
+struct list_job {
+    int idx;
+    string nas;
+    string dir;
+    DIR *dp;
+    vector<list_entry> entries;
+    int found;
+    int err;
+    struct timespec mtime;
+    pthread_t th;
+    int started;
+};
+
+
+static void *list_thread(void *ptr)
+{
+    struct list_job *job = (struct list_job *)ptr;
+    struct dirent *de;
+
+    errno = 0;
+    job->dp = nas_opendir(job->dir.c_str());
+    job->err = errno;
+    if(job->dp == NULL){
+        job->found = 0;
+        return NULL;
+    }
+
+    job->found = 1;
+    struct stat st;
+    if(fstat(dirfd(job->dp), &st) == 0){
+        job->mtime = st.st_mtim;
+    }
+    uint64_t id = nas_id(job->nas);
+    vector<string> subdirs;
+    while((de = readdir(job->dp)) != NULL){
+        if(de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0){
+            subdirs.push_back(de->d_name);
+        }
+        list_entry entry;
+        entry.name = de->d_name;
+        entry.ino = compose_ino(id, de->d_ino);
+        entry.type = de->d_type;
+        entry.nas = job->idx;
+        entry.has_st = 0;
+        entry.deleted = 0;
+        memset(&entry.st, 0, sizeof(entry.st));
+        entry.st.st_ino = entry.ino;
+        entry.st.st_mode = de->d_type << 12;
+        job->entries.push_back(entry);
+    }
+
+    /* a create below any of these needs no mkdir_parents stat */
+    string dir = strip_slash(job->dir.c_str());
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    known_dir_add_locked(dir);
+    for(size_t i = 0; i < subdirs.size(); i++){
+        known_dir_add_locked(dir + "/" + subdirs[i]);
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    return NULL;
+}
+
+
+/* open addressing set of names, used to merge the per-NAS listings */
+struct name_set {
+    vector<const string *> slots;
+    size_t count;
+};
+
+
+static void name_set_init(struct name_set *set, size_t hint)
+{
+    size_t cap = 16;
+    while(cap < hint * 2){
+        cap <<= 1;
+    }
+    set->slots.assign(cap, NULL);
+    set->count = 0;
+}
+
+
+static bool name_set_insert(struct name_set *set, const string *name)
+{
+    if((set->count + 1) * 2 > set->slots.size()){
+        vector<const string *> old;
+        old.swap(set->slots);
+        name_set_init(set, old.size());
+        for(size_t i = 0; i < old.size(); i++){
+            if(old[i] != NULL){
+                name_set_insert(set, old[i]);
+            }
+        }
+    }
+
+    size_t mask = set->slots.size() - 1;
+    for(size_t i = hash_fn(*name) & mask; ; i = (i + 1) & mask){
+        if(set->slots[i] == NULL){
+            set->slots[i] = name;
+            set->count++;
+            return true;
+        }
+        if(*set->slots[i] == *name){
+            return false;
+        }
+    }
+}
+
+
+/* merged listing of one SDFS directory kept by the directory cache.
+ * Listings shared with open directory handles are never modified; the
+ * cache copies them before an update. */
+struct dlist {
+    vector<list_entry> entries;
+    unordered_map<string, size_t> index;
+    vector<string> nas;
+    /* state of the directory on each NAS when the listing was taken */
+    vector<int> present;
+    vector<struct timespec> mtimes;
+    size_t live;
+    size_t bytes;
+    list<string>::iterator lru;
+};
+
+static unordered_map<string, shared_ptr<dlist> > dcache;
+static list<string> dcache_lru;
+static size_t dcache_entries;
+static size_t dcache_bytes;
+static unsigned long dcache_hits;
+static unsigned long dcache_misses;
+static unsigned long dcache_invalid;
+static pthread_mutex_t dcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static size_t dlist_entry_bytes(const list_entry &e)
+{
+    return sizeof(list_entry) + 2 * e.name.size() + 64;
+}
+
+
+static void split_parent(const char *path, string &parent, string &name)
+{
+    const char *p = strrchr(path, '/');
+
+    parent = (p == path) ? "/" : string(path, p - path);
+    name = p + 1;
+}
+
+
+/* caller holds dcache_mutex */
+static void dcache_drop_locked(unordered_map<string, shared_ptr<dlist> >::iterator itr)
+{
+    dcache_entries -= itr->second->live;
+    dcache_bytes -= itr->second->bytes;
+    dcache_lru.erase(itr->second->lru);
+    dcache.erase(itr);
+}
+
+
+static void dcache_drop(const string &path)
+{
+    pthread_mutex_lock(&dcache_mutex);
+    auto itr = dcache.find(path);
+    if(itr != dcache.end()){
+        dcache_drop_locked(itr);
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+
+/* caller holds dcache_mutex; returns a listing safe to modify in place */
+static dlist *dcache_writable(unordered_map<string, shared_ptr<dlist> >::iterator itr)
+{
+    if(itr->second.use_count() > 1){
+        shared_ptr<dlist> copy = make_shared<dlist>(*itr->second);
+        itr->second = copy;
+    }
+    return itr->second.get();
+}
+
+
+/* caller holds dcache_mutex */
+static void dcache_compact(dlist *l)
+{
+    if(l->entries.size() < 64 || l->live * 2 > l->entries.size()){
+        return;
+    }
+
+    vector<list_entry> entries;
+    entries.reserve(l->live);
+    l->index.clear();
+    for(size_t i = 0; i < l->entries.size(); i++){
+        if(!l->entries[i].deleted){
+            l->index[l->entries[i].name] = entries.size();
+            entries.push_back(l->entries[i]);
+        }
+    }
+    l->entries.swap(entries);
+}
+
+
+/* a NAS directory as dlist records it; taken without dcache_mutex */
+struct dir_state {
+    int present;
+    struct timespec mtime;
+};
+
+
+static dir_state dcache_dirstat(const string &dir)
+{
+    struct stat st;
+    dir_state ds = {0, {0, 0}};
+
+    if(nas_stat(dir.c_str(), &st) == 0){
+        ds.present = 1;
+        ds.mtime = st.st_mtim;
+    }
+    return ds;
+}
+
+
+/* caller holds dcache_mutex */
+static void dcache_restat(dlist *l, int nas, const dir_state &ds)
+{
+    l->present[nas] = ds.present;
+    if(ds.present){
+        l->mtimes[nas] = ds.mtime;
+    }
+}
+
+
+/* the listing is still valid if no NAS directory changed behind our back */
+static bool dcache_valid(const string &path, dlist *l)
+{
+    for(size_t i = 0; i < l->nas.size(); i++){
+        struct stat st;
+        string dir = l->nas[i] + path;
+        int present = (nas_stat(dir.c_str(), &st) == 0);
+        if(present != l->present[i]){
+            return false;
+        }
+        if(present && (st.st_mtim.tv_sec != l->mtimes[i].tv_sec ||
+                       st.st_mtim.tv_nsec != l->mtimes[i].tv_nsec)){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static shared_ptr<dlist> dcache_get(const string &path, const vector<string> &dirs)
+{
+    shared_ptr<dlist> l;
+
+    if(gdtnfs_conf.dcache_max == 0){
+        return l;
+    }
+
+    pthread_mutex_lock(&dcache_mutex);
+    auto itr = dcache.find(path);
+    if(itr != dcache.end()){
+        l = itr->second;
+        dcache_lru.splice(dcache_lru.begin(), dcache_lru, l->lru);
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+
+    if(l && (l->nas != dirs || !dcache_valid(path, l.get()))){
+        pthread_mutex_lock(&dcache_mutex);
+        itr = dcache.find(path);
+        if(itr != dcache.end() && itr->second == l){
+            dcache_drop_locked(itr);
+            dcache_invalid++;
+        }
+        pthread_mutex_unlock(&dcache_mutex);
+        l.reset();
+
+        /* changed behind our back: cached attributes below are suspect */
+        attr_del_tree(path);
+    }
+
+    pthread_mutex_lock(&dcache_mutex);
+    if(l){
+        dcache_hits++;
+    }else{
+        dcache_misses++;
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+
+    return l;
+}
+
+
+static void dcache_put(const string &path, shared_ptr<dlist> l)
+{
+    if(l->live > gdtnfs_conf.dcache_max / 4){
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_mutex);
+    auto itr = dcache.find(path);
+    if(itr != dcache.end()){
+        dcache_drop_locked(itr);
+    }
+    while(!dcache_lru.empty() && dcache_entries + l->live > gdtnfs_conf.dcache_max){
+        dcache_drop_locked(dcache.find(dcache_lru.back()));
+    }
+    dcache_lru.push_front(path);
+    l->lru = dcache_lru.begin();
+    dcache[path] = l;
+    dcache_entries += l->live;
+    dcache_bytes += l->bytes;
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+
+/* a name was created at path; fpath is where it went */
+static void dcache_add(const char *path, const char *fpath)
+{
+    string parent, name;
+    struct stat st;
+
+    if(gdtnfs_conf.dcache_max == 0){
+        return;
+    }
+    split_parent(path, parent, name);
+    string fnas = fpath_nas(fpath);
+
+    pthread_mutex_lock(&dcache_mutex);
+    bool cached = (dcache.find(parent) != dcache.end());
+    pthread_mutex_unlock(&dcache_mutex);
+    if(!cached){
+        return;
+    }
+
+    /* the NAS round trips run without dcache_mutex; the listing is
+     * looked up again for the update */
+    bool found_st = (nas_lstat(fpath, &st) == 0);
+    dir_state ds = dcache_dirstat(fnas + parent);
+
+    pthread_mutex_lock(&dcache_mutex);
+    auto itr = dcache.find(parent);
+    if(itr == dcache.end()){
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+    if(!found_st){
+        dcache_drop_locked(itr);
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+
+    dlist *l = dcache_writable(itr);
+    size_t nas = 0;
+    while(nas < l->nas.size() && l->nas[nas] != fnas){
+        nas++;
+    }
+    if(nas == l->nas.size()){
+        dcache_drop_locked(itr);
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+    dcache_restat(l, nas, ds);
+
+    auto found = l->index.find(name);
+    if(found == l->index.end() || l->entries[found->second].deleted){
+        list_entry entry;
+        entry.name = name;
+        entry.ino = map_ino(fnas, st.st_ino);
+        entry.type = IFTODT(st.st_mode);
+        entry.nas = nas;
+        entry.has_st = 0;
+        entry.deleted = 0;
+        memset(&entry.st, 0, sizeof(entry.st));
+        entry.st.st_ino = entry.ino;
+        entry.st.st_mode = st.st_mode & S_IFMT;
+
+        l->index[name] = l->entries.size();
+        l->entries.push_back(entry);
+        l->live++;
+        l->bytes += dlist_entry_bytes(entry);
+        dcache_entries++;
+        dcache_bytes += dlist_entry_bytes(entry);
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+
+/* a name was removed at path; it may still be visible from another NAS */
+static void dcache_remove(const char *path)
+{
+    string parent, name;
+
+    if(gdtnfs_conf.dcache_max == 0){
+        return;
+    }
+    split_parent(path, parent, name);
+    dcache_drop(path);
+
+    pthread_mutex_lock(&dcache_mutex);
+    auto itr = dcache.find(parent);
+    if(itr == dcache.end()){
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+    dlist *l = itr->second.get();
+    auto found = l->index.find(name);
+    if(found == l->index.end() || l->entries[found->second].deleted){
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+    vector<string> dirs = l->nas;
+    vector<int> present = l->present;
+    size_t enas = l->entries[found->second].nas;
+    pthread_mutex_unlock(&dcache_mutex);
+
+    /* the NAS round trips run without dcache_mutex */
+    dir_state ds = dcache_dirstat(dirs[enas] + parent);
+    present[enas] = ds.present;
+    vector<struct stat> sts(dirs.size());
+    vector<int> exists(dirs.size(), 0);
+    for(size_t i = 0; i < dirs.size(); i++){
+        string other = dirs[i] + path;
+        exists[i] = present[i] && nas_lstat(other.c_str(), &sts[i]) == 0;
+    }
+
+    pthread_mutex_lock(&dcache_mutex);
+    itr = dcache.find(parent);
+    if(itr == dcache.end()){
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+    if(itr->second->nas != dirs){
+        dcache_drop_locked(itr);
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+    l = dcache_writable(itr);
+    found = l->index.find(name);
+    if(found == l->index.end() || l->entries[found->second].deleted){
+        pthread_mutex_unlock(&dcache_mutex);
+        return;
+    }
+
+    list_entry &entry = l->entries[found->second];
+    dcache_restat(l, enas, ds);
+    for(size_t i = 0; i < dirs.size(); i++){
+        if(exists[i]){
+            entry.nas = i;
+            entry.ino = map_ino(dirs[i], sts[i].st_ino);
+            entry.st.st_ino = entry.ino;
+            entry.st.st_mode = sts[i].st_mode & S_IFMT;
+            pthread_mutex_unlock(&dcache_mutex);
+            return;
+        }
+    }
+
+    entry.deleted = 1;
+    l->live--;
+    l->bytes -= dlist_entry_bytes(entry);
+    dcache_entries--;
+    dcache_bytes -= dlist_entry_bytes(entry);
+    dcache_compact(l);
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+
+/* per-opendir merge cursor, stored in fi->fh */
+struct gdtnfs_dir {
+    string path;
+    pthread_mutex_t lock;
+    vector<list_job> jobs;
+    size_t joined;
+    size_t nas;
+    size_t pos;
+    struct name_set names;
+    /* entries handed out so far; offset n resumes at merged[n] */
+    vector<list_entry *> merged;
+    int found;
+    int err;
+    /* set when the listing is served from the directory cache */
+    shared_ptr<dlist> cached;
+};
+
+
+/* fills one directory entry into buf; non-zero when buf is full */
+typedef int (*dir_filler_t)(void *buf, const char *name, const struct stat *st,
+                            off_t off, int plus);
+
+
+static struct gdtnfs_dir *get_dir(struct fuse_file_info *fi)
+{
+    return (struct gdtnfs_dir *)(uintptr_t)fi->fh;
+}
+
+
+static void dir_join(struct gdtnfs_dir *d, size_t idx)
+{
+    while(d->joined <= idx && d->joined < d->jobs.size()){
+        if(d->jobs[d->joined].started){
+            pthread_join(d->jobs[d->joined].th, NULL);
+        }
+        d->joined++;
+    }
+}
+
+
+/* next name not shadowed by an earlier NAS, NULL at the end */
+static list_entry *dir_next(struct gdtnfs_dir *d)
+{
+    while(d->nas < d->jobs.size()){
+        dir_join(d, d->nas);
+        struct list_job &job = d->jobs[d->nas];
+        if(!job.found){
+            d->err = job.err;
+            d->nas++;
+            d->pos = 0;
+            continue;
+        }
+        d->found = 1;
+
+        while(d->pos < job.entries.size()){
+            list_entry *e = &job.entries[d->pos++];
+            if(name_set_insert(&d->names, &e->name)){
+                return e;
+            }
+        }
+        d->nas++;
+        d->pos = 0;
+    }
+
+    return NULL;
+}
+
+
+static void print_stats(void)
+{
+    pthread_mutex_lock(&dcache_mutex);
+    PRINT_INFO("dcache: %zu dirs, %zu entries, %zu bytes, %lu hits, %lu misses, %lu invalidated",
+               dcache.size(), dcache_entries, dcache_bytes,
+               dcache_hits, dcache_misses, dcache_invalid);
+    pthread_mutex_unlock(&dcache_mutex);
+
+    pthread_mutex_lock(&attr_mutex);
+    PRINT_INFO("attr cache: %zu entries, %lu hits, %lu misses",
+               attr_cache.size(), attr_hits, attr_misses);
+    pthread_mutex_unlock(&attr_mutex);
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    PRINT_INFO("resolve: %lu probes, %lu joined a probe in progress",
+               flight_probes, flight_joins);
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    pthread_mutex_lock(&fd_mutex);
+    PRINT_INFO("fd pool: %zu open, %zu idle, %lu opens, %lu shared, %lu warm reopens, %lu evicted",
+               fd_count, fd_idle.size(), fd_opens, fd_shared, fd_warm, fd_evicted);
+    pthread_mutex_unlock(&fd_mutex);
+
+    pthread_mutex_lock(&dio_mutex);
+    PRINT_INFO("direct io: %lu reads, %lu writes, %lu unaligned writes, %zu buffers",
+               dio_reads, dio_writes, dio_unaligned, dio_bufs);
+    pthread_mutex_unlock(&dio_mutex);
+}
+
+
+/* hand a completed merge over to the directory cache */
+static void dcache_publish(struct gdtnfs_dir *d)
+{
+    if(gdtnfs_conf.dcache_max == 0 || !d->found || d->merged.size() > gdtnfs_conf.dcache_max / 4){
+        return;
+    }
+
+    shared_ptr<dlist> l = make_shared<dlist>();
+    l->live = 0;
+    l->bytes = sizeof(dlist);
+    for(size_t i = 0; i < d->jobs.size(); i++){
+        l->nas.push_back(d->jobs[i].nas);
+        l->present.push_back(d->jobs[i].found);
+        l->mtimes.push_back(d->jobs[i].mtime);
+    }
+    l->entries.reserve(d->merged.size());
+    for(size_t i = 0; i < d->merged.size(); i++){
+        list_entry entry = *d->merged[i];
+        /* attributes go stale, readdirplus takes them again */
+        entry.has_st = 0;
+        memset(&entry.st, 0, sizeof(entry.st));
+        entry.st.st_ino = entry.ino;
+        entry.st.st_mode = entry.type << 12;
+        l->index[entry.name] = l->entries.size();
+        l->entries.push_back(entry);
+        l->live++;
+        l->bytes += dlist_entry_bytes(entry);
+    }
+
+    dcache_put(d->path, l);
+}
+
+
+static int dcache_readdir(struct gdtnfs_dir *d, void *buf, dir_filler_t filler,
+               off_t offset, int plus)
+{
+    const vector<list_entry> &entries = d->cached->entries;
+    string prefix = (d->path == "/") ? "/" : d->path + "/";
+
+    for(size_t next = offset; next < entries.size(); next++){
+        const list_entry &e = entries[next];
+        if(e.deleted){
+            continue;
+        }
+
+        struct stat st = e.st;
+        if(plus && e.name != "." && e.name != ".."){
+            string fpath = d->cached->nas[e.nas] + d->path + "/" + e.name;
+            if(nas_lstat(fpath.c_str(), &st) == 0){
+                st.st_ino = map_ino(d->cached->nas[e.nas], st.st_ino);
+                attr_put(prefix + e.name, &st);
+            }else{
+                st = e.st;
+            }
+        }
+
+        if (filler(buf, e.name.c_str(), &st, next + 1, plus)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+static int gdtnfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    PRINT("call %s", path);
+    day_access(path);
+
+    struct gdtnfs_dir *d = new gdtnfs_dir();
+    d->path = path;
+    pthread_mutex_init(&d->lock, NULL);
+    d->joined = 0;
+    d->nas = 0;
+    d->pos = 0;
+    d->found = 0;
+    d->err = ENOENT;
+    name_set_init(&d->names, 0);
+
+    vector<string> dirs;
+    list_dirs(path, dirs);
+    size_t size = dirs.size();
+
+    d->cached = dcache_get(path, dirs);
+    if(d->cached){
+        fi->fh = (uintptr_t)d;
+        return 0;
+    }
+
+    d->jobs.resize(size);
+    for (unsigned int i = 0; i < size; i++) {
+        d->jobs[i].idx = i;
+        d->jobs[i].nas = dirs[i];
+        d->jobs[i].dir = dirs[i] + path;
+        d->jobs[i].dp = NULL;
+        d->jobs[i].mtime.tv_sec = 0;
+        d->jobs[i].mtime.tv_nsec = 0;
+    }
+
+    /* list every NAS at once; readdir merges them in NAS order so that
+     * the first NAS holding a name wins, as in gdtnfs_fullpath */
+    for (unsigned int i = 0; i < size; i++) {
+        d->jobs[i].started = (pthread_create(&d->jobs[i].th, NULL, &list_thread, &d->jobs[i]) == 0);
+        if(!d->jobs[i].started){
+            list_thread(&d->jobs[i]);
+        }
+    }
+
+    fi->fh = (uintptr_t)d;
+    return 0;
+}
+
+
+static int gdtnfs_readdir(const char *path, void *buf, dir_filler_t filler,
+               off_t offset, struct fuse_file_info *fi, int plus)
+{
+    struct gdtnfs_dir *d = get_dir(fi);
+    string prefix = (strcmp(path, "/") == 0) ? "/" : string(path) + "/";
+    vector<list_entry *> added;
+
+    PRINT("call %s %ld", path, (long)offset);
+
+    if(d->cached){
+        return dcache_readdir(d, buf, filler, offset, plus);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    size_t next = min((size_t)offset, d->merged.size());
+    while(1){
+        list_entry *e;
+        if(next < d->merged.size()){
+            e = d->merged[next];
+        }else{
+            e = dir_next(d);
+            if(e == NULL){
+                dcache_publish(d);
+                break;
+            }
+            d->merged.push_back(e);
+            added.push_back(e);
+        }
+
+        /* readdirplus: take the attributes relative to the open directory
+         * instead of resolving each name again later */
+        if(plus && !e->has_st){
+            DIR *dp = d->jobs[e->nas].dp;
+            if(fstatat(dirfd(dp), e->name.c_str(), &e->st, AT_SYMLINK_NOFOLLOW) == 0){
+                e->st.st_ino = e->ino;
+                e->has_st = 1;
+                if(e->name != "." && e->name != ".."){
+                    attr_put(prefix + e->name, &e->st);
+                }
+            }
+        }
+
+        PRINT("name: %s", e->name.c_str());
+        if (filler(buf, e->name.c_str(), &e->st, next + 1, plus)) {
+            break;
+        }
+        next++;
+    }
+
+    if(!d->found && d->nas >= d->jobs.size()){
+        int err = d->err;
+        pthread_mutex_unlock(&d->lock);
+        return -err;
+    }
+
+    /* the listing tells where each entry lives, so the lookups that
+     * follow an ls -l or rsync need no probing */
+    long time = now_ms();
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    for (size_t j = 0; j < added.size(); j++) {
+        const string &name = added[j]->name;
+        if(name == "." || name == ".."){
+            continue;
+        }
+        loc_t loc = {d->jobs[added[j]->nas].nas, time};
+        loc_cache[prefix + name] = loc;
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+    pthread_mutex_unlock(&d->lock);
+    
+    return 0;
+}
+
+
+static int gdtnfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct gdtnfs_dir *d = get_dir(fi);
+
+    PRINT("call %s", path);
+    dir_join(d, d->jobs.size());
+    d->cached.reset();
+    for (size_t i = 0; i < d->jobs.size(); i++) {
+        if(d->jobs[i].dp != NULL){
+            closedir(d->jobs[i].dp);
+        }
+    }
+    pthread_mutex_destroy(&d->lock);
+    delete d;
+
+    return 0;
+}
+
+
+static int mknod_process(const char *fpath, mode_t mode, dev_t rdev)
+{
+    int res;
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+
+    if (S_ISREG(mode)) {
+        res = openat(dirfd, rel, O_CREAT | O_EXCL | O_WRONLY, mode);
+        if (res >= 0)
+            res = close(res);
+    } else if (S_ISFIFO(mode))
+        res = mkfifoat(dirfd, rel, mode);
+    else
+        res = mknodat(dirfd, rel, mode, rdev);
+
+    return res;
+}
+
+
+static int gdtnfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 1);
+	
+    res = mknod_process(fpath, mode, rdev);
+    if (res == -1 && errno == ENOENT && parents_lost(fpath))
+        res = mknod_process(fpath, mode, rdev);
+    if (res == -1)
+        return -errno;
+
+    loc_set(path, fpath_nas(fpath));
+    dcache_add(path, fpath);
+    attr_del(path);
+    attr_del_parent(path);
+    day_written(path);
+    return 0;
+}
+
+
+static int gdtnfs_mkdir(const char *path, mode_t mode)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+
+	gdtnfs_fullpath(fpath, path, 1);
+	res = nas_mkdir(fpath, mode);
+	if (res == -1 && errno == ENOENT && parents_lost(fpath))
+		res = nas_mkdir(fpath, mode);
+	
+	string s_path = fpath;
+    delete_ump(s_path);
+
+	if (res == -1)
+        return -errno;
+
+    known_dir_add(fpath);
+    loc_set(path, fpath_nas(fpath));
+    dcache_add(path, fpath);
+    attr_del(path);
+    attr_del_parent(path);
+    return 0;
+}
+
+
+static int gdtnfs_unlink(const char *path)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    PRINT("unlink %s", fpath);
+    res = nas_unlink(fpath, 0);
+    loc_del(path);
+    if (res == -1)
+        return -errno;
+
+    fd_drop(fpath);
+    attr_del(path);
+    attr_del_parent(path);
+    dcache_remove(path);
+    return 0;
+}
+
+
+static int gdtnfs_rmdir(const char *path)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    res = nas_unlink(fpath, AT_REMOVEDIR);
+    loc_del(path);
+    if (res == -1)
+        return -errno;
+
+    known_dir_del(fpath);
+    attr_del_tree(path);
+    attr_del_parent(path);
+    dcache_remove(path);
+    return 0;
+}
+
+
+static int gdtnfs_symlink(const char *from, const char *to)
+{
+    int res;
+    char fto[PATH_MAX] = {0};
+    
+    PRINT("Before: %s %s", from, to);
+
+    gdtnfs_fullpath(fto, to, 1);
+    PRINT("After: %s %s", from, fto);
+    const char *rel;
+    int dirfd = root_at(fto, &rel);
+    res = symlinkat(from, dirfd, rel);
+    if (res == -1 && errno == ENOENT && parents_lost(fto))
+        res = symlinkat(from, dirfd, rel);
+    if (res == -1)
+        return -errno;
+
+    dcache_add(to, fto);
+    attr_del_parent(to);
+    return 0;
+}
+
+
+/*
+ * rename across NAS. rename(2) fails with EXDEV there, so the data is
+ * copied into a temporary next to the destination, renamed over it on
+ * the destination NAS and only then removed from the source: readers
+ * of the destination see the old or the complete new file. Directories
+ * are created on the destination first, their files are then moved by
+ * move_threads workers and the emptied source directories removed.
+ */
+#define MOVE_CHUNK (64 * 1024 * 1024)
+static unsigned long move_seq;
+
+
+static int move_data(int in, int out)
+{
+    bool offload = true;
+
+    while(1){
+        ssize_t n;
+        if(offload){
+            /* lets NFS 4.2 copy on the server; sendfile when it cannot */
+            n = copy_file_range(in, NULL, out, NULL, MOVE_CHUNK, 0);
+            if(n == -1 && (errno == EXDEV || errno == EINVAL ||
+                           errno == ENOSYS || errno == EOPNOTSUPP)){
+                offload = false;
+                continue;
+            }
+        }else{
+            n = sendfile(out, in, NULL, MOVE_CHUNK);
+        }
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        if(n == 0){
+            return 0;
+        }
+    }
+}
+
+
+#ifdef HAVE_SETXATTR
+static void move_xattrs(int in, int out)
+{
+    ssize_t len = flistxattr(in, NULL, 0);
+    if(len <= 0){
+        return;
+    }
+    vector<char> names(len);
+    len = flistxattr(in, names.data(), len);
+    for(ssize_t i = 0; i < len; i += strlen(&names[i]) + 1){
+        const char *name = &names[i];
+        ssize_t size = fgetxattr(in, name, NULL, 0);
+        if(size < 0){
+            continue;
+        }
+        vector<char> value(size + 1);
+        size = fgetxattr(in, name, value.data(), size);
+        if(size >= 0 && fsetxattr(out, name, value.data(), size, 0) == -1){
+            PRINT_ERR("Error: fsetxattr(%s) %s", name, strerror(errno));
+        }
+    }
+}
+#endif
+
+
+/* moves a non-directory from ffrom to fto on another NAS */
+static int move_file(const char *ffrom, const char *fto)
+{
+    struct stat st;
+    int res = 0;
+
+    if(nas_lstat(ffrom, &st) == -1){
+        return -errno;
+    }
+
+    char tmp[PATH_MAX];
+    char buf[PATH_MAX];
+    strcpy(buf, fto);
+    const char *base = strrchr(fto, '/') + 1;
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    unsigned long seq = move_seq++;
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+    snprintf(tmp, PATH_MAX, "%s/.%s.gdtnfs-mv.%d.%lu", dirname(buf), base, getpid(), seq);
+
+    const char *rel;
+    int dirfd = root_at(tmp, &rel);
+    struct timespec ts[2] = {st.st_atim, st.st_mtim};
+
+    if(S_ISREG(st.st_mode)){
+        int in = nas_open(ffrom, O_RDONLY, 0);
+        if(in == -1){
+            return -errno;
+        }
+        int out = openat(dirfd, rel, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+        if(out == -1){
+            res = -errno;
+            close(in);
+            return res;
+        }
+        res = move_data(in, out);
+        if(res == 0){
+#ifdef HAVE_SETXATTR
+            move_xattrs(in, out);
+#endif
+            /* chown drops set-id bits, chmod puts them back */
+            if(fchown(out, st.st_uid, st.st_gid) == -1 ||
+               fchmod(out, st.st_mode & 07777) == -1){
+                PRINT("owner of %s not kept: %s", fto, strerror(errno));
+            }
+            futimens(out, ts);
+        }
+        if(close(out) == -1 && res == 0){
+            res = -errno;
+        }
+        close(in);
+    }else if(S_ISLNK(st.st_mode)){
+        char target[PATH_MAX];
+        const char *rfrom;
+        int dfrom = root_at(ffrom, &rfrom);
+        ssize_t len = readlinkat(dfrom, rfrom, target, PATH_MAX - 1);
+        if(len == -1){
+            return -errno;
+        }
+        target[len] = '\0';
+        if(symlinkat(target, dirfd, rel) == -1){
+            return -errno;
+        }
+        fchownat(dirfd, rel, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dirfd, rel, ts, AT_SYMLINK_NOFOLLOW);
+    }else{
+        if(mknodat(dirfd, rel, st.st_mode, st.st_rdev) == -1){
+            return -errno;
+        }
+        fchownat(dirfd, rel, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dirfd, rel, ts, AT_SYMLINK_NOFOLLOW);
+    }
+
+    if(res == 0 && nas_rename(tmp, fto) == -1){
+        res = -errno;
+    }
+    if(res != 0){
+        nas_unlink(tmp, 0);
+        return res;
+    }
+
+    /* the destination is complete from here on */
+    if(nas_unlink(ffrom, 0) == -1){
+        PRINT_ERR("Error: unlink(%s) after move %s", ffrom, strerror(errno));
+    }
+    fd_drop(ffrom);
+    return 0;
+}
+
+
+struct move_job_t {
+    vector<pair<string, string> > files;
+    size_t next;
+    int res;
+    pthread_mutex_t lock;
+};
+
+
+static void *move_worker(void *arg)
+{
+    move_job_t *job = (move_job_t *)arg;
+
+    while(1){
+        pthread_mutex_lock(&job->lock);
+        if(job->next >= job->files.size()){
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        int res = move_file(job->files[i].first.c_str(), job->files[i].second.c_str());
+        if(res != 0){
+            PRINT_ERR("Error: move %s -> %s %s", job->files[i].first.c_str(),
+                      job->files[i].second.c_str(), strerror(-res));
+            pthread_mutex_lock(&job->lock);
+            job->res = res;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+}
+
+
+/* creates the directories below ffrom under fto and collects the files,
+ * dirs in pre-order */
+static int move_walk(const string &ffrom, const string &fto, move_job_t *job,
+                     vector<pair<string, string> > &dirs)
+{
+    DIR *dp = nas_opendir(ffrom.c_str());
+    if(dp == NULL){
+        return -errno;
+    }
+
+    int res = 0;
+    struct dirent *de;
+    while((de = readdir(dp)) != NULL){
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0){
+            continue;
+        }
+        string from = ffrom + "/" + de->d_name;
+        string to = fto + "/" + de->d_name;
+        struct stat st;
+        if(nas_lstat(from.c_str(), &st) == -1){
+            continue;
+        }
+        if(!S_ISDIR(st.st_mode)){
+            job->files.push_back(make_pair(from, to));
+            continue;
+        }
+        if(nas_mkdir(to.c_str(), st.st_mode & 07777) == -1 && errno != EEXIST){
+            res = -errno;
+            break;
+        }
+        dirs.push_back(make_pair(from, to));
+        res = move_walk(from, to, job, dirs);
+        if(res != 0){
+            break;
+        }
+    }
+    closedir(dp);
+
+    return res;
+}
+
+
+static int move_tree(const char *ffrom, const char *fto)
+{
+    struct stat st, tst;
+
+    if(nas_lstat(ffrom, &st) == -1){
+        return -errno;
+    }
+    if(!S_ISDIR(st.st_mode)){
+        if(nas_lstat(fto, &tst) == 0 && S_ISDIR(tst.st_mode)){
+            return -EISDIR;
+        }
+        return move_file(ffrom, fto);
+    }
+
+    if(nas_mkdir(fto, st.st_mode & 07777) == -1){
+        if(errno != EEXIST){
+            return -errno;
+        }
+        /* like rename(2), only over an empty directory */
+        if(nas_lstat(fto, &tst) == -1 || !S_ISDIR(tst.st_mode)){
+            return -ENOTDIR;
+        }
+        DIR *dp = nas_opendir(fto);
+        if(dp == NULL){
+            return -errno;
+        }
+        struct dirent *de;
+        int entries = 0;
+        while((de = readdir(dp)) != NULL){
+            if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0){
+                entries++;
+            }
+        }
+        closedir(dp);
+        if(entries > 0){
+            return -ENOTEMPTY;
+        }
+    }
+
+    move_job_t job;
+    job.next = 0;
+    job.res = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    vector<pair<string, string> > dirs;
+    dirs.push_back(make_pair(string(ffrom), string(fto)));
+    int res = move_walk(ffrom, fto, &job, dirs);
+
+    if(res == 0){
+        size_t workers = min((size_t)max(gdtnfs_conf.move_threads, 1u), job.files.size());
+        vector<pthread_t> th(workers);
+        size_t started = 0;
+        for(; started < workers; started++){
+            if(pthread_create(&th[started], NULL, &move_worker, &job) != 0){
+                break;
+            }
+        }
+        if(started == 0){
+            move_worker(&job);
+        }
+        for(size_t i = 0; i < started; i++){
+            pthread_join(th[i], NULL);
+        }
+        res = job.res;
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    /* deepest first; a source directory still holding a file that
+     * failed to move stays */
+    for(auto itr = dirs.rbegin(); itr != dirs.rend(); ++itr){
+        if(nas_lstat(itr->first.c_str(), &st) == 0){
+            const char *rel;
+            int dirfd = root_at(itr->second.c_str(), &rel);
+            struct timespec ts[2] = {st.st_atim, st.st_mtim};
+            fchownat(dirfd, rel, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+            utimensat(dirfd, rel, ts, AT_SYMLINK_NOFOLLOW);
+        }
+        if(res == 0){
+            nas_unlink(itr->first.c_str(), AT_REMOVEDIR);
+        }
+    }
+
+    return res;
+}
+
+
+/* a cross-NAS move copies the files on the NAS, so buffered writes to
+ * anything below path are flushed first and a move of a file still open
+ * for writing is refused. On a single-threaded mount copying a whole
+ * directory would stall every other request; EXDEV leaves it to the
+ * caller, mv then copies it through the mount file by file */
+static int move_prepare(const char *path, const char *ffrom)
+{
+    struct stat st;
+    int res = 0;
+
+    if(single_thread && nas_lstat(ffrom, &st) == 0 && S_ISDIR(st.st_mode)){
+        return -EXDEV;
+    }
+
+    string dir = string(path) + "/";
+    pthread_mutex_lock(&files_mutex);
+    for(auto itr = open_files.begin(); itr != open_files.end(); ++itr){
+        struct gdtnfs_file *f = *itr;
+        if(f->path != path && f->path.compare(0, dir.size(), dir) != 0){
+            continue;
+        }
+        pthread_mutex_lock(&f->lock);
+        wbuf_flush_locked(f);
+        pthread_mutex_unlock(&f->lock);
+        if((f->fde->flags & O_ACCMODE) != O_RDONLY){
+            res = -EBUSY;
+        }
+    }
+    pthread_mutex_unlock(&files_mutex);
+
+    return res;
+}
+
+
+/* where a missing to goes: the source NAS when the rules would find it
+ * there, so that a plain rename does, otherwise wherever it is routed */
+static void rename_target(char fto[PATH_MAX], const char *to, const char *ffrom)
+{
+    string nas = fpath_nas(ffrom);
+    unordered_set<string> cands;
+    bool local = !nas.empty();
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    if(local && nas_candidates_locked(to, cands)){
+        local = (cands.count(nas) > 0);
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    if(!local){
+        search_path(fto, to);
+        return;
+    }
+
+    char buf[PATH_MAX];
+    snprintf(fto, PATH_MAX, "%s%s", nas.c_str(), to);
+    strcpy(buf, fto);
+    string dir = string(dirname(buf)) + "/";
+    if(mkdir_parents(dir.c_str(), 0777) != 0){
+        PRINT_ERR("Error: mkdir_parents(%s) %s", dir.c_str(), strerror(errno));
+    }
+}
+
+
+static int gdtnfs_rename(const char *from, const char *to, unsigned int flags)
+{
+    int res;
+    char ffrom[PATH_MAX] = {0};
+    char fto[PATH_MAX] = {0};
+    
+    PRINT("call %s %s", from, to);
+    PRINT("flags = %d", flags);
+    gdtnfs_fullpath(ffrom, from, 0);
+    if(gdtnfs_fullpath_process(fto, to) == 0){
+        rename_target(fto, to, ffrom);
+    }
+
+	string s_path = fto;
+    delete_ump(s_path);
+
+    if (flags)
+        return -EINVAL;
+
+    PRINT("rename(%s, %s)", ffrom, fto);
+    res = nas_rename(ffrom, fto);
+    if (res == -1 && errno == ENOENT && parents_lost(fto))
+        res = nas_rename(ffrom, fto);
+    if (res == -1 && errno == EXDEV) {
+        PRINT("cross-NAS rename(%s, %s)", ffrom, fto);
+        res = move_prepare(from, ffrom);
+        if (res == 0)
+            res = move_tree(ffrom, fto);
+        if (res != 0) {
+            /* a directory may have moved in part */
+            known_dir_del(ffrom);
+            known_dir_del(fto);
+            attr_del_tree(from);
+            attr_del_tree(to);
+            dcache_drop(from);
+            dcache_drop(to);
+            errno = -res;
+            res = -1;
+        }
+    }
+    loc_del(from);
+    loc_del(to);
+    loc_del_tree(from);
+    loc_del_tree(to);
+    if (res == -1)
+        return -errno;
+
+    known_dir_del(ffrom);
+    known_dir_del(fto);
+    fd_drop(ffrom);
+    fd_drop(fto);
+    attr_del_tree(from);
+    attr_del_tree(to);
+    attr_del_parent(from);
+    attr_del_parent(to);
+    dcache_remove(from);
+    dcache_drop(to);
+    dcache_add(to, fto);
+    attr_del_parent(to);
+    return 0;
+}
+
+
+static int gdtnfs_link(const char *from, const char *to)
+{
+    int res;
+    char ffrom[PATH_MAX] = {0};
+    char fto[PATH_MAX] = {0};
+    
+    PRINT("Before: %s %s", from, to);
+
+    gdtnfs_fullpath(ffrom, from, 0);
+    gdtnfs_fullpath(fto, to, 1);
+
+    PRINT("After: %s %s", ffrom, fto);
+    const char *rfrom, *rto;
+    int dfrom = root_at(ffrom, &rfrom);
+    int dto = root_at(fto, &rto);
+    res = linkat(dfrom, rfrom, dto, rto, 0);
+    if (res == -1 && errno == ENOENT && parents_lost(fto))
+        res = linkat(dfrom, rfrom, dto, rto, 0);
+    if (res == -1)
+        return -errno;
+
+    dcache_add(to, fto);
+    attr_del(from);
+    attr_del_parent(to);
+    return 0;
+}
+
+
+static int gdtnfs_chmod(const char *path, mode_t mode,
+             struct fuse_file_info *fi)
+{
+    (void) fi;
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    res = fchmodat(dirfd, rel, mode, 0);
+    if (res == -1)
+        return -errno;
+
+    pthread_mutex_lock(&attr_mutex);
+    struct stat *st = attr_find_locked(path);
+    if (st != NULL) {
+        st->st_mode = (st->st_mode & S_IFMT) | (mode & ~S_IFMT);
+        clock_gettime(CLOCK_REALTIME, &st->st_ctim);
+    }
+    pthread_mutex_unlock(&attr_mutex);
+    return 0;
+}
+
+
+static int gdtnfs_chown(const char *path, uid_t uid, gid_t gid,
+             struct fuse_file_info *fi)
+{
+    (void) fi;
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    res = fchownat(dirfd, rel, uid, gid, AT_SYMLINK_NOFOLLOW);
+    if (res == -1)
+        return -errno;
+
+    /* the NAS may also have cleared set-id bits, take them again */
+    attr_del(path);
+    return 0;
+}
+
+
+static int gdtnfs_truncate(const char *path, off_t size,
+            struct fuse_file_info *fi)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+
+    if (fi != NULL) {
+        struct gdtnfs_file *f = get_file(fi);
+        wbuf_flush_keep(f);
+        res = ftruncate(f->fd, size);
+    } else {
+        wbuf_flush_path(path);
+        res = truncate(fpath, size);
+    }
+    ra_invalidate_path(path);
+    if (res == -1)
+        return -errno;
+
+    pthread_mutex_lock(&attr_mutex);
+    struct stat *st = attr_find_locked(path);
+    if (st != NULL) {
+        st->st_size = size;
+        st->st_blocks = (size + 511) / 512;
+        clock_gettime(CLOCK_REALTIME, &st->st_mtim);
+        st->st_ctim = st->st_mtim;
+    }
+    pthread_mutex_unlock(&attr_mutex);
+    return 0;
+}
+
+
+#ifdef HAVE_UTIMENSAT
+static int gdtnfs_utimens(const char *path, const struct timespec ts[2],
+               struct fuse_file_info *fi)
+{
+    (void) fi;
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+
+    /* don't use utime/utimes since they follow symlinks */
+    const char *rel;
+    int dirfd = root_at(fpath, &rel);
+    res = utimensat(dirfd, rel, ts, AT_SYMLINK_NOFOLLOW);
+    if (res == -1)
+        return -errno;
+
+    pthread_mutex_lock(&attr_mutex);
+    struct stat *st = attr_find_locked(path);
+    if (st != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (ts == NULL) {
+            st->st_atim = now;
+            st->st_mtim = now;
+        } else {
+            if (ts[0].tv_nsec == UTIME_NOW)
+                st->st_atim = now;
+            else if (ts[0].tv_nsec != UTIME_OMIT)
+                st->st_atim = ts[0];
+            if (ts[1].tv_nsec == UTIME_NOW)
+                st->st_mtim = now;
+            else if (ts[1].tv_nsec != UTIME_OMIT)
+                st->st_mtim = ts[1];
+        }
+        st->st_ctim = now;
+    }
+    pthread_mutex_unlock(&attr_mutex);
+    return 0;
+}
+#endif
+
+
+static int open_flags(int flags)
+{
+    if(!gdtnfs_conf.writeback){
+        return flags;
+    }
+
+    /* with writeback cache the kernel may read pages of a write-only
+     * file, and it positions O_APPEND writes itself */
+    if((flags & O_ACCMODE) == O_WRONLY){
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    flags &= ~O_APPEND;
+
+    return flags;
+}
+
+
+static cache_policy_t set_open_policy(const char *path, struct fuse_file_info *fi)
+{
+    cache_policy_t policy = find_cache_policy(path);
+
+    fi->keep_cache = policy.keep_cache;
+    fi->direct_io = policy.direct_io;
+    return policy;
+}
+
+
+/*
+ * Reserve the expected size of a new fixed-rate sensor file up front,
+ * so the NAS allocates it in one piece and extending writes find the
+ * blocks there. KEEP_SIZE leaves st_size alone; NFS before 4.2 cannot
+ * allocate and the file is then written as usual.
+ */
+static off_t prealloc_file(int fd, off_t size)
+{
+    struct stat st;
+
+    if(size <= 0 || fstat(fd, &st) == -1 || st.st_size > 0){
+        return 0;
+    }
+    if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1){
+        if(errno != EOPNOTSUPP){
+            PRINT_ERR("Error: fallocate(%jd) %s", (intmax_t)size, strerror(errno));
+        }
+        return 0;
+    }
+    return size;
+}
+
+
+/* give back what was reserved past the end of the data once the last
+ * handle of the file goes, whichever handle that is */
+static void prealloc_trim(struct gdtnfs_file *f)
+{
+    struct stat st;
+
+    pthread_mutex_lock(&files_mutex);
+    auto pitr = preallocs.find(f->path);
+    if(pitr == preallocs.end()){
+        pthread_mutex_unlock(&files_mutex);
+        return;
+    }
+    for(auto itr = open_files.begin(); itr != open_files.end(); ++itr){
+        if(*itr != f && (*itr)->path == f->path){
+            pthread_mutex_unlock(&files_mutex);
+            return;
+        }
+    }
+    off_t size = pitr->second;
+    preallocs.erase(pitr);
+    trimming.insert(f->path);
+    pthread_mutex_unlock(&files_mutex);
+
+    /* the NAS calls run without files_mutex; new opens of this file wait
+     * in new_file so nothing is written where the hole is punched. The
+     * last handle may be read-only, the punch needs a writable fd */
+    struct fd_entry *e = NULL;
+    int fd = f->fd;
+    if((f->fde->flags & O_ACCMODE) == O_RDONLY){
+        e = fd_get(f->fde->fpath.c_str(), O_WRONLY, 0);
+        fd = (e != NULL) ? e->fd : -1;
+    }
+    if(fd != -1 && fstat(fd, &st) == 0 && st.st_size < size &&
+       fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 st.st_size, size - st.st_size) == -1){
+        PRINT_ERR("Error: trim %s %s", f->path.c_str(), strerror(errno));
+    }
+    if(e != NULL){
+        fd_put(e);
+    }
+
+    pthread_mutex_lock(&files_mutex);
+    trimming.erase(f->path);
+    pthread_cond_broadcast(&trim_cond);
+    pthread_mutex_unlock(&files_mutex);
+}
+
+
+static int gdtnfs_create(const char *path, mode_t mode,
+              struct fuse_file_info *fi)
+{
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 1);
+
+	string s_path = fpath;
+    delete_ump(s_path);
+
+	
+    struct fd_entry *e = fd_get(fpath, open_flags(fi->flags), mode);
+    if (e == NULL && errno == ENOENT && parents_lost(fpath))
+        e = fd_get(fpath, open_flags(fi->flags), mode);
+
+    if (e == NULL)
+        return -errno;
+
+    loc_set(path, fpath_nas(fpath));
+    dcache_add(path, fpath);
+    attr_del(path);
+    attr_del_parent(path);
+    day_written(path);
+    cache_policy_t policy = set_open_policy(path, fi);
+    struct gdtnfs_file *f = new_file(e, path, fpath);
+    off_t reserved = prealloc_file(e->fd, policy.prealloc);
+    if (reserved > 0) {
+        pthread_mutex_lock(&files_mutex);
+        preallocs[path] = reserved;
+        pthread_mutex_unlock(&files_mutex);
+    }
+    if (policy.direct_io)
+        dio_open(f, fpath, open_flags(fi->flags));
+    fi->fh = (uintptr_t)f;
+    return 0;
+}
+
+
+static int gdtnfs_open(const char *path, struct fuse_file_info *fi)
+{
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    day_access(path);
+    gdtnfs_fullpath(fpath, path, 0);
+
+    struct fd_entry *e = fd_get(fpath, open_flags(fi->flags), 0);
+    if (e == NULL && errno == ENOENT && loc_retry(path, fpath))
+        e = fd_get(fpath, open_flags(fi->flags), 0);
+    if (e == NULL)
+        return -errno;
+
+    if (fi->flags & O_TRUNC)
+        attr_del(path);
+    cache_policy_t policy = set_open_policy(path, fi);
+    struct gdtnfs_file *f = new_file(e, path, fpath);
+    if (policy.direct_io)
+        dio_open(f, fpath, open_flags(fi->flags));
+    fi->fh = (uintptr_t)f;
+    return 0;
+}
+
+
+static int gdtnfs_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+
+    if(fi != NULL) {
+        struct gdtnfs_file *f = get_file(fi);
+        wbuf_flush_range(f->path, size, offset);
+        if(f->dfd != -1)
+            return dio_read(f, buf, size, offset);
+        if(gdtnfs_conf.ra_max > 0)
+            return ra_read(f, buf, size, offset);
+        res = pread(f->fd, buf, size, offset);
+        if (res == -1)
+            res = -errno;
+        return res;
+    }
+
+    gdtnfs_fullpath(fpath, path, 0);
+    struct fd_entry *e = fd_get(fpath, O_RDONLY, 0);
+    if (e == NULL)
+        return -errno;
+
+    res = pread(e->fd, buf, size, offset);
+    if (res == -1)
+        res = -errno;
+
+    fd_put(e);
+    return res;
+}
+
+
+static int gdtnfs_write(const char *path, const char *buf, size_t size,
+             off_t offset, struct fuse_file_info *fi)
+{
+    int res;
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+
+    if(fi != NULL && get_file(fi)->dfd != -1) {
+        res = dio_write(get_file(fi), buf, size, offset);
+    } else if(fi != NULL) {
+        res = wbuf_write(get_file(fi), buf, size, offset);
+    } else {
+        gdtnfs_fullpath(fpath, path, 0);
+        struct fd_entry *e = fd_get(fpath, O_WRONLY, 0);
+        if (e == NULL)
+            return -errno;
+
+        res = pwrite(e->fd, buf, size, offset);
+        if (res == -1)
+            res = -errno;
+
+        fd_put(e);
+    }
+
+    if (res > 0) {
+        attr_write(path, offset + res);
+        ra_written(path, fi);
+    }
+    return res;
+}
+
+
+/*
+ * Pooled capacity of the NAS from the statvfs values read_config keeps,
+ * so df costs no NAS round trip. Block counts are scaled to the first
+ * NAS's fragment size.
+ */
+static int gdtnfs_statfs(const char *path, struct statvfs *stbuf)
+{
+    unordered_set<string> nas;
+    bool first = true;
+
+    PRINT("call %s", path);
+    memset(stbuf, 0, sizeof(*stbuf));
+
+#if USE_LOCK
+    pthread_mutex_lock(&mutex);
+#endif
+    bool filtered = gdtnfs_conf.statfs_pattern && nas_candidates_locked(path, nas);
+
+    size_t size = target_dirs.size();
+    for (unsigned int i = 0; i < size; i++) {
+        if(filtered && !nas.count(target_dirs[i].name)){
+            continue;
+        }
+        const struct statvfs &vfs = target_dirs[i].vfs;
+        if(first){
+            stbuf->f_bsize = vfs.f_bsize;
+            stbuf->f_frsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+            stbuf->f_fsid = vfs.f_fsid;
+            stbuf->f_flag = vfs.f_flag;
+            stbuf->f_namemax = vfs.f_namemax;
+            first = false;
+        }
+        unsigned long frsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+        stbuf->f_blocks += (uintmax_t)vfs.f_blocks * frsize / stbuf->f_frsize;
+        stbuf->f_bfree += (uintmax_t)vfs.f_bfree * frsize / stbuf->f_frsize;
+        stbuf->f_bavail += (uintmax_t)vfs.f_bavail * frsize / stbuf->f_frsize;
+        stbuf->f_files += vfs.f_files;
+        stbuf->f_ffree += vfs.f_ffree;
+        stbuf->f_favail += vfs.f_favail;
+        if(vfs.f_namemax < stbuf->f_namemax){
+            stbuf->f_namemax = vfs.f_namemax;
+        }
+    }
+#if USE_LOCK
+    pthread_mutex_unlock(&mutex);
+#endif
+
+    if(first)
+        return -ENOENT;
+
+    return 0;
+}
+
+
+static int gdtnfs_release(const char *path, struct fuse_file_info *fi)
+{
+    PRINT("call %s", path);
+
+    struct gdtnfs_file *f = get_file(fi);
+    wbuf_flush(f);
+    ra_wait(f);
+    prealloc_trim(f);
+    if(f->dfde != NULL)
+        fd_put(f->dfde);
+    fd_put(f->fde);
+    free_file(f);
+    return 0;
+}
+
+
+static int gdtnfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    PRINT("call %s", path);
+    return wbuf_flush(get_file(fi));
+}
+
+
+
+static int gdtnfs_fsync(const char *path, int isdatasync,
+             struct fuse_file_info *fi)
+{
+    char fpath[PATH_MAX] = {0};
+    PRINT("call %s", path);
+    
+    if(fi == NULL){
+        gdtnfs_fullpath(fpath, path, 0);
+        struct fd_entry *e = fd_get(fpath, O_RDONLY, 0);
+        if (e == NULL)
+            return -errno;
+        int res = isdatasync ? fdatasync(e->fd) : fsync(e->fd);
+        if (res == -1)
+            res = -errno;
+        fd_put(e);
+        return res;
+    }
+
+    struct gdtnfs_file *f = get_file(fi);
+    int res = wbuf_flush(f);
+    if(res != 0)
+        return res;
+
+    return group_fsync(f->nas, f->fd, isdatasync);
+}
+
+
+/* mode is passed through, so KEEP_SIZE reservations and PUNCH_HOLE
+ * reach the NAS; plain allocation falls back to posix_fallocate where
+ * the NAS cannot allocate */
+static int gdtnfs_fallocate(const char *path, int mode,
+            off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    char fpath[PATH_MAX] = {0};
+    struct fd_entry *e = NULL;
+
+    PRINT("call %s", path);
+
+    /* data buffered by any handle must reach the NAS before the range
+     * is allocated, punched or shifted under it */
+    res = wbuf_flush_path(path);
+    if (res != 0)
+        return res;
+
+    if(fi == NULL) {
+        gdtnfs_fullpath(fpath, path, 0);
+        e = fd_get(fpath, O_WRONLY, 0);
+        if (e == NULL)
+            return -errno;
+        fd = e->fd;
+    } else {
+        fd = get_file(fi)->fd;
+    }
+
+    res = fallocate(fd, mode, offset, length);
+    if (res == -1 && errno == EOPNOTSUPP && mode == 0)
+        res = -posix_fallocate(fd, offset, length);
+    else if (res == -1)
+        res = -errno;
+    /* anything but allocating (punch, zero, collapse, insert) changes
+     * what is read back */
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        ra_invalidate_path(path);
+    attr_del(path);
+
+    if(e != NULL)
+        fd_put(e);
+    return res;
+}
+
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+#define COPY_CHUNK (1024 * 1024)
+
+/* pread/pwrite loop for backends that cannot copy_file_range between
+ * each other; the pooled fds are shared, so no file offsets are used */
+static ssize_t copy_range_slow(int in, off_t off_in, int out, off_t off_out, size_t len)
 {
-    int ret = pthread_detach(pthread_self());
-    if(ret != 0){
-        PRINT_ERR("Error: pthread_detach() of ncache_thread %s\n", strerror(errno));
+    char *buf = (char *)malloc(min(len, (size_t)COPY_CHUNK));
+    if(buf == NULL){
+        return -ENOMEM;
     }
-	
-	unsigned int *interval = &ncache_lifetime;
-	unsigned int memory_span = (*interval) * 1000;
 
-	PRINT(" ncache interval : %d", *interval);
-	
-	while(1) {
-	    sleep(*interval);
-		organize_ump(memory_span);
-	}
+    ssize_t done = 0;
+    int err = 0;
+    while((size_t)done < len){
+        ssize_t n = pread(in, buf, min(len - done, (size_t)COPY_CHUNK), off_in + done);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            err = (n == -1) ? errno : 0;
+            break;
+        }
+        ssize_t w = 0;
+        while(w < n){
+            ssize_t res = pwrite(out, buf + w, n - w, off_out + done + w);
+            if(res == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                err = errno;
+                break;
+            }
+            w += res;
+        }
+        done += w;
+        if(w < n){
+            break;
+        }
+    }
+    free(buf);
+
+    /* a short copy is reported as such, an error only when nothing moved */
+    return (done == 0 && err != 0) ? -err : done;
 }
 
-static void start_ncache_thread(void)
+
+/*
+ * cp inside the mount: the data goes from one backend fd to the other
+ * without passing through the kernel and the daemon twice, and NFS 4.2
+ * copies on the server when both are on the same NAS.
+ */
+static ssize_t gdtnfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+            off_t off_in, const char *path_out, struct fuse_file_info *fi_out,
+            off_t off_out, size_t len, int flags)
 {
-    pthread_t ncache_th;
-    unsigned int ncache_interval = ncache_lifetime;
-	PRINT("ncache lifetime : %d", ncache_lifetime);
-    int ret = pthread_create(&ncache_th, NULL, &ncache_thread, &ncache_interval);
-    if(ret != 0) {
-  	    fprintf(stderr, "Error: pthread_create %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    struct gdtnfs_file *fin = get_file(fi_in);
+    struct gdtnfs_file *fout = get_file(fi_out);
+    ssize_t res;
+
+    PRINT("call %s %s", path_in, path_out);
+
+    /* buffered data of any handle landing on the output range later
+     * would overwrite the copy; a write error stays with its handle */
+    wbuf_flush_range(fin->path, len, off_in);
+    wbuf_flush_range(fout->path, len, off_out);
+    pthread_mutex_lock(&fout->lock);
+    ra_invalidate_locked(fout);
+    pthread_mutex_unlock(&fout->lock);
+
+    loff_t in = off_in, out = off_out;
+    res = copy_file_range(fin->fd, &in, fout->fd, &out, len, flags);
+    if (res == -1 && flags == 0 &&
+        (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        res = copy_range_slow(fin->fd, off_in, fout->fd, off_out, len);
+    else if (res == -1)
+        res = -errno;
+
+    if (res > 0) {
+        attr_write(path_out, off_out + res);
+        ra_written(path_out, fi_out);
     }
+    return res;
 }
+#endif
+
 
-static void *gdtnfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+/*
+ * SEEK_DATA/SEEK_HOLE (and SEEK_END) answered by the NAS, so sparse and
+ * preallocated sensor files can be copied without reading their holes.
+ * Only positional I/O is done on the shared backend fds, so moving the
+ * fd's offset here disturbs nobody.
+ */
+static off_t gdtnfs_lseek(const char *path, off_t off, int whence,
+            struct fuse_file_info *fi)
 {
-    (void) conn;
-    cfg->use_ino = 1;
+    struct gdtnfs_file *f = get_file(fi);
+
+    PRINT("call %s", path);
 
-    cfg->entry_timeout = 0;
-    cfg->attr_timeout = 0;
-    cfg->negative_timeout = 0;
+    /* data buffered by any handle decides where the holes and the end
+     * are; a write error stays deferred on its handle as well */
+    int res = wbuf_flush_path(path);
+    if (res != 0)
+        return res;
 
-    start_config_thread();
-	start_ncache_thread();
-	PRINT("start_ncache_thread");
-	
-    return NULL;
+    off_t pos = lseek(f->fd, off, whence);
+    if (pos == -1)
+        return -errno;
+    return pos;
 }
+#endif
 
 
-static int gdtnfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+#ifdef HAVE_SETXATTR
+/* xattr operations are optional and can safely be left unimplemented */
+static int gdtnfs_setxattr(const char *path, const char *name, const char *value,
+            size_t size, int flags)
 {
-    (void) fi;
-    int res;
     char fpath[PATH_MAX] = {0};
 
     PRINT("call %s", path);
     gdtnfs_fullpath(fpath, path, 0);
-    res = lstat(fpath, stbuf);
+    int res = lsetxattr(fpath, name, value, size, flags);
     if (res == -1)
         return -errno;
-
     return 0;
 }
 
 
-static int gdtnfs_access(const char *path, int mask)
+static int gdtnfs_getxattr(const char *path, const char *name, char *value,
+            size_t size)
 {
-    int res;
     char fpath[PATH_MAX] = {0};
 
     PRINT("call %s", path);
     gdtnfs_fullpath(fpath, path, 0);
-    res = access(fpath, mask);
+    int res = lgetxattr(fpath, name, value, size);
     if (res == -1)
         return -errno;
-
-    return 0;
+    return res;
 }
 
 
-static int gdtnfs_readlink(const char *path, char *buf, size_t size)
+static int gdtnfs_listxattr(const char *path, char *list, size_t size)
 {
-    int res;
     char fpath[PATH_MAX] = {0};
 
     PRINT("call %s", path);
     gdtnfs_fullpath(fpath, path, 0);
-    res = readlink(fpath, buf, size - 1);
+    int res = llistxattr(fpath, list, size);
     if (res == -1)
         return -errno;
+    return res;
+}
 
-    buf[res] = '\0';
+
+static int gdtnfs_removexattr(const char *path, const char *name)
+{
+    char fpath[PATH_MAX] = {0};
+
+    PRINT("call %s", path);
+    gdtnfs_fullpath(fpath, path, 0);
+    int res = lremovexattr(fpath, name);
+    if (res == -1)
+        return -errno;
     return 0;
 }
+#endif /* HAVE_SETXATTR */
 
 
-static int find_vector(vector<string> vec, string str)
+/*
+ * Low-level operations. They map inodes to SDFS paths through the inode
+ * table and reply with the results of the path operations above.
+ */
+static int lookup_stat(const char *path, const string &hint,
+                       struct stat *st, string &nas)
 {
-    size_t len = vec.size();
-    for (size_t i = 0; i < len; i++){
-        if(vec[i] == str){
-            return 1;
+    char fpath[PATH_MAX] = {0};
+
+    if(attr_get(path, st))
+        return 0;
+
+    wbuf_flush_path(path);
+    if(!hint.empty()){
+        snprintf(fpath, PATH_MAX, "%s%s", hint.c_str(), path);
+        if(nas_lstat(fpath, st) == 0){
+            nas = hint;
+            st->st_ino = map_ino(nas, st->st_ino);
+            attr_put(path, st);
+            return 0;
         }
     }
+
+    gdtnfs_fullpath(fpath, path, 0);
+    if(nas_lstat(fpath, st) == -1 &&
+       (errno != ENOENT || !loc_retry(path, fpath) || nas_lstat(fpath, st) == -1))
+        return -errno;
+
+    nas = fpath_nas(fpath);
+    st->st_ino = map_ino(nas, st->st_ino);
+    attr_put(path, st);
+    if(S_ISDIR(st->st_mode))
+        known_dir_add(fpath);
     return 0;
 }
 
 
-static int gdtnfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-               off_t offset, struct fuse_file_info *fi,
-               enum fuse_readdir_flags flags)
+static int make_entry(fuse_ino_t parent, const char *name, const char *path,
+                      struct fuse_entry_param *e)
 {
-    DIR *dp;
-    struct dirent *de;
+    string nas;
 
-    (void) offset;
-    (void) fi;
-    (void) flags;
-    char fpath[PATH_MAX] = {0};
-    vector<string> pre_dirs;
-    int flag = 0;
-    int errsv = 0;
+    memset(e, 0, sizeof(*e));
+    int res = lookup_stat(path, inode_child_nas(parent, name), &e->attr, nas);
+    if(res != 0)
+        return res;
 
-    PRINT("call %s", path);
-    
-#if USE_LOCK
-    pthread_mutex_lock(&mutex);
-#endif
-    size_t size = target_dirs.size();
-    for (unsigned int i = 0; i < size; i++) {
-        memset(fpath, 0, sizeof(fpath));
-        strcpy(fpath, target_dirs[i].name.c_str());
-        strncat(fpath, path, PATH_MAX);
-        
-        PRINT("for %d: %s %s", i, path, fpath);
-        
-        errno = 0;
-        dp = opendir(fpath);
-        errsv = errno;
-        if (dp != NULL) {
-            flag = 1;
-            PRINT("for %d: if_before errro:%s", i, strerror(errsv));
-
-            while ((de = readdir(dp)) != NULL) {
-                string dir_name;
-                dir_name = string(de->d_name);
-                if(find_vector(pre_dirs, dir_name) == 0){
-                    pre_dirs.push_back(dir_name);
-                    
-                    struct stat st;
-                    memset(&st, 0, sizeof(st));
-                    st.st_ino = de->d_ino;
-                    st.st_mode = de->d_type << 12;
-                    PRINT("name: %s", de->d_name);
-                    if (filler(buf, de->d_name, &st, 0, (fuse_fill_dir_flags)0)) {
-                        break;
-                    }
-                }
-            }
-        }
-        closedir(dp);
-    }
-#if USE_LOCK
-    pthread_mutex_unlock(&mutex);
-#endif
-    
-    if(flag != 1){
-        return -errsv;
-    }
-    
+    cache_policy_t policy = find_cache_policy(path);
+    e->ino = inode_ref(parent, name, nas, &e->attr);
+    e->entry_timeout = policy.entry_timeout;
+    e->attr_timeout = policy.attr_timeout;
     return 0;
-    
 }
 
 
-static int gdtnfs_mknod(const char *path, mode_t mode, dev_t rdev)
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        const string &path, int res)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    struct fuse_entry_param e;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 1);
-	
-    if (S_ISREG(mode)) {
-        res = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
-        if (res >= 0)
-            res = close(res);
-    } else if (S_ISFIFO(mode))
-        res = mkfifo(fpath, mode);
+    if(res == 0)
+        res = make_entry(parent, name, path.c_str(), &e);
+    if(res != 0)
+        fuse_reply_err(req, -res);
     else
-        res = mknod(fpath, mode, rdev);
-    if (res == -1)
-        return -errno;
+        fuse_reply_entry(req, &e);
+}
 
-    return 0;
+
+/* path for an op on an open file; the handle's when it was unlinked */
+static string file_path(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    string path;
+
+    if(inode_path(ino, path) != 0)
+        path = get_file(fi)->path;
+    return path;
 }
 
 
-static int gdtnfs_mkdir(const char *path, mode_t mode)
+static void gdtnfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string path;
 
-    PRINT("call %s", path);
+    int res = inode_child_path(parent, name, path);
+    PRINT("call %s", path.c_str());
+    reply_entry(req, parent, name, path, res);
+}
 
-	gdtnfs_fullpath(fpath, path, 1);
-	res = mkdir(fpath, mode);
-	
-	string s_path = fpath;
-    delete_ump(s_path);
 
-	if (res == -1)
-        return -errno;
+static void gdtnfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    inode_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
 
-    return 0;
+
+static void gdtnfs_ll_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets)
+{
+    for (size_t i = 0; i < count; i++)
+        inode_forget(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
 }
 
 
-static int gdtnfs_unlink(const char *path)
+static void gdtnfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string path;
+    string nas;
+    struct stat st;
+
+    int res = inode_path(ino, path);
+    PRINT("call %s", path.c_str());
+    if (res == 0 && fi != NULL) {
+        res = gdtnfs_getattr(path.c_str(), &st, fi);
+    } else if (res == 0) {
+        res = lookup_stat(path.c_str(), inode_nas(ino), &st, nas);
+    } else if (fi != NULL) {
+        struct gdtnfs_file *f = get_file(fi);
+        wbuf_flush_keep(f);
+        res = (fstat(f->fd, &st) == -1) ? -errno : 0;
+        st.st_ino = map_ino(f->nas, st.st_ino);
+    }
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    PRINT("unlink %s", fpath);
-    res = unlink(fpath);
-    if (res == -1)
-        return -errno;
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    return 0;
+    inode_update(ino, nas, &st);
+    fuse_reply_attr(req, &st, find_cache_policy(path.c_str()).attr_timeout);
 }
 
 
-static int gdtnfs_rmdir(const char *path)
+static void gdtnfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                              int to_set, struct fuse_file_info *fi)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string path;
+    string nas;
+    struct stat st;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    res = rmdir(fpath);
-    if (res == -1)
-        return -errno;
+    int res = inode_path(ino, path);
+    if (res != 0 && fi != NULL) {
+        path = get_file(fi)->path;
+        res = 0;
+    }
 
-    return 0;
+    if (res == 0 && (to_set & FUSE_SET_ATTR_MODE))
+        res = gdtnfs_chmod(path.c_str(), attr->st_mode, fi);
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+        res = gdtnfs_chown(path.c_str(), uid, gid, fi);
+    }
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+        res = gdtnfs_truncate(path.c_str(), attr->st_size, fi);
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+#ifdef HAVE_UTIMENSAT
+        struct timespec ts[2];
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1] = ts[0];
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            ts[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+            ts[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            ts[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+            ts[1] = attr->st_mtim;
+        res = gdtnfs_utimens(path.c_str(), ts, fi);
+#else
+        res = -ENOSYS;
+#endif
+    }
+
+    if (res == 0 && fi != NULL)
+        res = gdtnfs_getattr(path.c_str(), &st, fi);
+    else if (res == 0)
+        res = lookup_stat(path.c_str(), inode_nas(ino), &st, nas);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    inode_update(ino, nas, &st);
+    fuse_reply_attr(req, &st, find_cache_policy(path.c_str()).attr_timeout);
 }
 
 
-static int gdtnfs_symlink(const char *from, const char *to)
+static void gdtnfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-    int res;
-    char fto[PATH_MAX] = {0};
-    
-    PRINT("Before: %s %s", from, to);
+    string path;
+    char buf[PATH_MAX + 1];
 
-    gdtnfs_fullpath(fto, to, 1);
-    PRINT("After: %s %s", from, fto);
-    res = symlink(from, fto);
-    if (res == -1)
-        return -errno;
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_readlink(path.c_str(), buf, sizeof(buf));
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_readlink(req, buf);
+}
 
-    return 0;
+
+static void gdtnfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode, dev_t rdev)
+{
+    string path;
+
+    int res = inode_child_path(parent, name, path);
+    if (res == 0)
+        res = gdtnfs_mknod(path.c_str(), mode, rdev);
+    reply_entry(req, parent, name, path, res);
 }
 
 
-static int gdtnfs_rename(const char *from, const char *to, unsigned int flags)
+static void gdtnfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode)
 {
-    int res;
-    char ffrom[PATH_MAX] = {0};
-    char fto[PATH_MAX] = {0};
-    
-    PRINT("call %s %s", from, to);
-    PRINT("flags = %d", flags);
-    gdtnfs_fullpath(ffrom, from, 0);
-    gdtnfs_fullpath(fto, to, 1);
+    string path;
 
-	string s_path = fto;
-    delete_ump(s_path);
+    int res = inode_child_path(parent, name, path);
+    if (res == 0)
+        res = gdtnfs_mkdir(path.c_str(), mode);
+    reply_entry(req, parent, name, path, res);
+}
 
-    if (flags)
-        return -EINVAL;
 
-    PRINT("rename(%s, %s)", ffrom, fto);
-    res = rename(ffrom, fto);
-    if (res == -1)
-        return -errno;
+static void gdtnfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    string path;
 
-    return 0;
+    int res = inode_child_path(parent, name, path);
+    if (res == 0)
+        res = gdtnfs_unlink(path.c_str());
+    if (res == 0)
+        inode_unlink(parent, name);
+    fuse_reply_err(req, -res);
 }
 
 
-static int gdtnfs_link(const char *from, const char *to)
+static void gdtnfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    int res;
-    char ffrom[PATH_MAX] = {0};
-    char fto[PATH_MAX] = {0};
-    
-    PRINT("Before: %s %s", from, to);
+    string path;
 
-    gdtnfs_fullpath(ffrom, from, 0);
-    gdtnfs_fullpath(fto, to, 1);
+    int res = inode_child_path(parent, name, path);
+    if (res == 0)
+        res = gdtnfs_rmdir(path.c_str());
+    if (res == 0)
+        inode_unlink(parent, name);
+    fuse_reply_err(req, -res);
+}
 
-    PRINT("After: %s %s", ffrom, fto);
-    res = link(ffrom, fto);
-    if (res == -1)
-        return -errno;
 
-    return 0;
+static void gdtnfs_ll_symlink(fuse_req_t req, const char *link,
+                              fuse_ino_t parent, const char *name)
+{
+    string path;
+
+    int res = inode_child_path(parent, name, path);
+    if (res == 0)
+        res = gdtnfs_symlink(link, path.c_str());
+    reply_entry(req, parent, name, path, res);
 }
 
 
-static int gdtnfs_chmod(const char *path, mode_t mode,
-             struct fuse_file_info *fi)
+static void gdtnfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname,
+                             unsigned int flags)
 {
-    (void) fi;
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string from;
+    string to;
+
+    int res = inode_child_path(parent, name, from);
+    if (res == 0)
+        res = inode_child_path(newparent, newname, to);
+    if (res == 0)
+        res = gdtnfs_rename(from.c_str(), to.c_str(), flags);
+    if (res == 0)
+        inode_rename(parent, name, newparent, newname);
+    fuse_reply_err(req, -res);
+}
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    res = chmod(fpath, mode);
-    if (res == -1)
-        return -errno;
 
-    return 0;
+static void gdtnfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                           const char *newname)
+{
+    string from;
+    string to;
+
+    int res = inode_path(ino, from);
+    if (res == 0)
+        res = inode_child_path(newparent, newname, to);
+    if (res == 0)
+        res = gdtnfs_link(from.c_str(), to.c_str());
+    reply_entry(req, newparent, newname, to, res);
 }
 
 
-static int gdtnfs_chown(const char *path, uid_t uid, gid_t gid,
-             struct fuse_file_info *fi)
+/*
+ * With the writeback cache the kernel owns i_size while it caches dirty
+ * pages, so only keep cached pages when the backend file did not change
+ * since the attributes the kernel last saw.
+ */
+static void keep_unchanged(fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    (void) fi;
-    int res;
-    char fpath[PATH_MAX] = {0};
+    struct stat old;
+    struct stat st;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    res = lchown(fpath, uid, gid);
-    if (res == -1)
-        return -errno;
+    if (!inode_attr(ino, &old) || fstat(get_file(fi)->fd, &st) == -1)
+        return;
 
-    return 0;
+    fi->keep_cache = (st.st_size == old.st_size &&
+                      st.st_mtim.tv_sec == old.st_mtim.tv_sec &&
+                      st.st_mtim.tv_nsec == old.st_mtim.tv_nsec);
 }
 
 
-static int gdtnfs_truncate(const char *path, off_t size,
-            struct fuse_file_info *fi)
+static void gdtnfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string path;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_open(path.c_str(), fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    if (fi != NULL)
-        res = ftruncate(fi->fh, size);
-    else
-        res = truncate(fpath, size);
-    if (res == -1)
-        return -errno;
+    if (gdtnfs_conf.writeback && !fi->keep_cache)
+        keep_unchanged(ino, fi);
 
-    return 0;
+    /* the open was interrupted, nobody will release the handle */
+    if (fuse_reply_open(req, fi) == -ENOENT)
+        gdtnfs_release(path.c_str(), fi);
 }
 
 
-#ifdef HAVE_UTIMENSAT
-static int gdtnfs_utimens(const char *path, const struct timespec ts[2],
-               struct fuse_file_info *fi)
+static void gdtnfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             mode_t mode, struct fuse_file_info *fi)
 {
-    (void) fi;
-    int res;
-    char fpath[PATH_MAX] = {0};
-
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
+    string path;
+    struct fuse_entry_param e;
+
+    int res = inode_child_path(parent, name, path);
+    if (res == 0)
+        res = gdtnfs_create(path.c_str(), mode, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    /* don't use utime/utimes since they follow symlinks */
-    res = utimensat(0, fpath, ts, AT_SYMLINK_NOFOLLOW);
-    if (res == -1)
-        return -errno;
+    res = make_entry(parent, name, path.c_str(), &e);
+    if (res != 0) {
+        gdtnfs_release(path.c_str(), fi);
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    return 0;
+    if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+        gdtnfs_release(path.c_str(), fi);
+        inode_forget(e.ino, 1);
+    }
 }
-#endif
 
 
-static int gdtnfs_create(const char *path, mode_t mode,
-              struct fuse_file_info *fi)
+static void gdtnfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    struct gdtnfs_file *f = get_file(fi);
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 1);
+    char *buf = (char *)malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-	string s_path = fpath;
-    delete_ump(s_path);
+    int res = gdtnfs_read(f->path.c_str(), buf, size, off, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
+}
 
-	
-    res = open(fpath, fi->flags, mode);
 
-    if (res == -1)
-        return -errno;
+static void gdtnfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                            size_t size, off_t off, struct fuse_file_info *fi)
+{
+    string path = file_path(ino, fi);
 
-    fi->fh = res;
-    return 0;
+    int res = gdtnfs_write(path.c_str(), buf, size, off, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
 }
 
 
-static int gdtnfs_open(const char *path, struct fuse_file_info *fi)
+static void gdtnfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    fuse_reply_err(req, -gdtnfs_flush(get_file(fi)->path.c_str(), fi));
+}
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
 
-    res = open(fpath, fi->flags);
-    if (res == -1)
-        return -errno;
+static void gdtnfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    string path = get_file(fi)->path;
 
-    fi->fh = res;
-    return 0;
+    fuse_reply_err(req, -gdtnfs_release(path.c_str(), fi));
 }
 
 
-static int gdtnfs_read(const char *path, char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+static void gdtnfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
-    char fpath[PATH_MAX] = {0};
-
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
+    fuse_reply_err(req, -gdtnfs_fsync(get_file(fi)->path.c_str(), datasync, fi));
+}
 
-    if(fi == NULL)
-        fd = open(fpath, O_RDONLY);
-    else
-        fd = fi->fh;
-    
-    if (fd == -1)
-        return -errno;
 
-    res = pread(fd, buf, size, offset);
-    if (res == -1)
-        res = -errno;
+static void gdtnfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                                off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    string path = file_path(ino, fi);
 
-    if(fi == NULL)
-        close(fd);
-    return res;
+    fuse_reply_err(req, -gdtnfs_fallocate(path.c_str(), mode, offset, length, fi));
 }
 
 
-static int gdtnfs_write(const char *path, const char *buf, size_t size,
-             off_t offset, struct fuse_file_info *fi)
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+static void gdtnfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                                      struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                                      off_t off_out, struct fuse_file_info *fi_out,
+                                      size_t len, int flags)
 {
-    int fd;
-    int res;
-    char fpath[PATH_MAX] = {0};
-
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
+    string path_out = file_path(ino_out, fi_out);
 
-    (void) fi;
-    if(fi == NULL)
-        fd = open(fpath, O_WRONLY);
+    ssize_t res = gdtnfs_copy_file_range(get_file(fi_in)->path.c_str(), fi_in, off_in,
+                                         path_out.c_str(), fi_out, off_out, len, flags);
+    if (res < 0)
+        fuse_reply_err(req, -res);
     else
-        fd = fi->fh;
-    
-    if (fd == -1)
-        return -errno;
+        fuse_reply_write(req, res);
+}
+#endif
 
-    res = pwrite(fd, buf, size, offset);
-    if (res == -1)
-        res = -errno;
 
-    if(fi == NULL)
-        close(fd);
-    return res;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void gdtnfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                            struct fuse_file_info *fi)
+{
+    off_t res = gdtnfs_lseek(get_file(fi)->path.c_str(), off, whence, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_lseek(req, res);
 }
+#endif
 
 
-static int gdtnfs_statfs(const char *path, struct statvfs *stbuf)
+static void gdtnfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string path;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_opendir(path.c_str(), fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    res = statvfs(fpath, stbuf);
-    if (res == -1)
-        return -errno;
+    if (fuse_reply_open(req, fi) == -ENOENT)
+        gdtnfs_releasedir(path.c_str(), fi);
+}
+
+
+/* reply buffer of one readdir call */
+struct ll_dirbuf {
+    fuse_req_t req;
+    fuse_ino_t ino;
+    string prefix;
+    char *p;
+    size_t size;
+    size_t len;
+};
+
+
+static int ll_filler(void *buf, const char *name, const struct stat *st,
+                     off_t off, int plus)
+{
+    struct ll_dirbuf *b = (struct ll_dirbuf *)buf;
+    size_t rest = b->size - b->len;
+    size_t len;
 
+    if (!plus) {
+        len = fuse_add_direntry(b->req, b->p + b->len, rest, name, st, off);
+        if (len > rest)
+            return 1;
+        b->len += len;
+        return 0;
+    }
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.attr = *st;
+    if (fuse_add_direntry_plus(b->req, NULL, 0, name, &e, off) > rest)
+        return 1;
+
+    /* the kernel takes a lookup reference for every entry with an inode;
+     * "." and ".." and entries whose stat failed (st_nlink 0) get none */
+    if (st->st_nlink > 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        cache_policy_t policy = find_cache_policy((b->prefix + name).c_str());
+        e.ino = inode_ref(b->ino, name, "", st);
+        e.entry_timeout = policy.entry_timeout;
+        e.attr_timeout = policy.attr_timeout;
+    }
+    b->len += fuse_add_direntry_plus(b->req, b->p + b->len, rest, name, &e, off);
     return 0;
 }
 
 
-static int gdtnfs_release(const char *path, struct fuse_file_info *fi)
+static void readdir_reply(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                          struct fuse_file_info *fi, int plus)
 {
-    //(void) path;
-    char fpath[PATH_MAX] = {0};
-    
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    
-    close(fi->fh);
-    return 0;
+    struct gdtnfs_dir *d = get_dir(fi);
+    struct ll_dirbuf b;
+
+    b.req = req;
+    b.ino = ino;
+    b.prefix = (d->path == "/") ? "/" : d->path + "/";
+    b.size = size;
+    b.len = 0;
+    b.p = (char *)malloc(size);
+    if (b.p == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int res = gdtnfs_readdir(d->path.c_str(), &b, ll_filler, off, fi, plus);
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, b.p, b.len);
+    free(b.p);
 }
 
 
+static void gdtnfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t off, struct fuse_file_info *fi)
+{
+    readdir_reply(req, ino, size, off, fi, 0);
+}
+
 
-static int gdtnfs_fsync(const char *path, int isdatasync,
-             struct fuse_file_info *fi)
+static void gdtnfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                  off_t off, struct fuse_file_info *fi)
 {
-    char fpath[PATH_MAX] = {0};
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    
-    (void) isdatasync;
-    (void) fi;
-    return 0;
+    readdir_reply(req, ino, size, off, fi, 1);
 }
 
 
-#ifdef HAVE_POSIX_FALLOCATE
-static int gdtnfs_fallocate(const char *path, int mode,
-            off_t offset, off_t length, struct fuse_file_info *fi)
+static void gdtnfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
-    char fpath[PATH_MAX] = {0};
+    string path = get_dir(fi)->path;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
+    fuse_reply_err(req, -gdtnfs_releasedir(path.c_str(), fi));
+}
 
-    (void) fi;
 
-    if (mode)
-        return -EOPNOTSUPP;
+static void gdtnfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    string path;
+    struct statvfs st;
 
-    if(fi == NULL)
-        fd = open(fpath, O_WRONLY);
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_statfs(path.c_str(), &st);
+    if (res != 0)
+        fuse_reply_err(req, -res);
     else
-        fd = fi->fh;
-    
-    if (fd == -1)
-        return -errno;
+        fuse_reply_statfs(req, &st);
+}
 
-    res = -posix_fallocate(fd, offset, length);
 
-    if(fi == NULL)
-        close(fd);
-    return res;
+static void gdtnfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    string path;
+
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_access(path.c_str(), mask);
+    fuse_reply_err(req, -res);
 }
-#endif
 
 
 #ifdef HAVE_SETXATTR
-/* xattr operations are optional and can safely be left unimplemented */
-static int gdtnfs_setxattr(const char *path, const char *name, const char *value,
-            size_t size, int flags)
+static void gdtnfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                               const char *value, size_t size, int flags)
 {
-    char fpath[PATH_MAX] = {0};
+    string path;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    int res = lsetxattr(fpath, name, value, size, flags);
-    if (res == -1)
-        return -errno;
-    return 0;
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_setxattr(path.c_str(), name, value, size, flags);
+    fuse_reply_err(req, -res);
 }
 
 
-static int gdtnfs_getxattr(const char *path, const char *name, char *value,
-            size_t size)
+/* size 0 asks for the length only */
+static void xattr_reply(fuse_req_t req, int res, const char *value, size_t size)
 {
-    char fpath[PATH_MAX] = {0};
-
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    int res = lgetxattr(fpath, name, value, size);
-    if (res == -1)
-        return -errno;
-    return res;
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else if (size == 0)
+        fuse_reply_xattr(req, res);
+    else
+        fuse_reply_buf(req, value, res);
 }
 
 
-static int gdtnfs_listxattr(const char *path, char *list, size_t size)
+static void gdtnfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                               size_t size)
 {
-    char fpath[PATH_MAX] = {0};
+    string path;
+    char *value = NULL;
+
+    int res = inode_path(ino, path);
+    if (res == 0 && size > 0 && (value = (char *)malloc(size)) == NULL)
+        res = -ENOMEM;
+    if (res == 0)
+        res = gdtnfs_getxattr(path.c_str(), name, value, size);
+    xattr_reply(req, res, value, size);
+    free(value);
+}
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    int res = llistxattr(fpath, list, size);
-    if (res == -1)
-        return -errno;
-    return res;
+
+static void gdtnfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    string path;
+    char *list = NULL;
+
+    int res = inode_path(ino, path);
+    if (res == 0 && size > 0 && (list = (char *)malloc(size)) == NULL)
+        res = -ENOMEM;
+    if (res == 0)
+        res = gdtnfs_listxattr(path.c_str(), list, size);
+    xattr_reply(req, res, list, size);
+    free(list);
 }
 
 
-static int gdtnfs_removexattr(const char *path, const char *name)
+static void gdtnfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
-    char fpath[PATH_MAX] = {0};
+    string path;
 
-    PRINT("call %s", path);
-    gdtnfs_fullpath(fpath, path, 0);
-    int res = lremovexattr(fpath, name);
-    if (res == -1)
-        return -errno;
-    return 0;
+    int res = inode_path(ino, path);
+    if (res == 0)
+        res = gdtnfs_removexattr(path.c_str(), name);
+    fuse_reply_err(req, -res);
 }
 #endif /* HAVE_SETXATTR */
 
 
 // for C++
-static struct fuse_operations gdtnfs_oper = {
-    gdtnfs_getattr,
-    gdtnfs_readlink,
-    gdtnfs_mknod,
-    gdtnfs_mkdir,
-    gdtnfs_unlink,
-    gdtnfs_rmdir,
-    gdtnfs_symlink, //NULL, // gdtnfs_symlink, // symlink
-    gdtnfs_rename,
-    gdtnfs_link, //  NULL, // gdtnfs_link, // link
-    gdtnfs_chmod,
-    gdtnfs_chown,
-    gdtnfs_truncate,
-    gdtnfs_open,
-    gdtnfs_read,
-    gdtnfs_write,
-    gdtnfs_statfs,
-    NULL, // flush
-    gdtnfs_release,
-    gdtnfs_fsync,
+static struct fuse_lowlevel_ops gdtnfs_ll_oper = {
+    gdtnfs_init,
+    NULL, // destroy
+    gdtnfs_ll_lookup,
+    gdtnfs_ll_forget,
+    gdtnfs_ll_getattr,
+    gdtnfs_ll_setattr,
+    gdtnfs_ll_readlink,
+    gdtnfs_ll_mknod,
+    gdtnfs_ll_mkdir,
+    gdtnfs_ll_unlink,
+    gdtnfs_ll_rmdir,
+    gdtnfs_ll_symlink,
+    gdtnfs_ll_rename,
+    gdtnfs_ll_link,
+    gdtnfs_ll_open,
+    gdtnfs_ll_read,
+    gdtnfs_ll_write,
+    gdtnfs_ll_flush,
+    gdtnfs_ll_release,
+    gdtnfs_ll_fsync,
+    gdtnfs_ll_opendir,
+    gdtnfs_ll_readdir,
+    gdtnfs_ll_releasedir,
+    NULL, // fsyncdir
+    gdtnfs_ll_statfs,
 #ifdef HAVE_SETXATTR
-    gdtnfs_setxattr,
-    gdtnfs_getxattr,
-    gdtnfs_listxattr,
-    gdtnfs_removexattr,
+    gdtnfs_ll_setxattr,
+    gdtnfs_ll_getxattr,
+    gdtnfs_ll_listxattr,
+    gdtnfs_ll_removexattr,
 #else
     NULL, // setxattr
     NULL, // getxattr
     NULL, // listxattr
     NULL, // removexattr
 #endif
-    NULL, // opendir
-    gdtnfs_readdir,
-    NULL, // releasedir
-    //gdtnfs_releasedir,
-    NULL, // fsyncdir
-    gdtnfs_init,
-    NULL, // destroy
-    gdtnfs_access,
-    gdtnfs_create,
-    NULL, // lock
-#ifdef HAVE_UTIMENSAT
-    gdtnfs_utimens,
-#else
-    NULL, // utimens
-#endif
+    gdtnfs_ll_access,
+    gdtnfs_ll_create,
+    NULL, // getlk
+    NULL, // setlk
     NULL, // bmap
     NULL, // ioctl
     NULL, // poll
     NULL, // write_buf
-    NULL, // read_buf
+    NULL, // retrieve_reply
+    gdtnfs_ll_forget_multi,
     NULL, // flock
-#ifdef HAVE_POSIX_FALLOCATE
-    gdtnfs_fallocate,
-#else
-    NULL, // fallocate
+    gdtnfs_ll_fallocate,
+    gdtnfs_ll_readdirplus,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+    gdtnfs_ll_copy_file_range,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+    gdtnfs_ll_lseek,
 #endif
 };
 
@@ -1171,6 +6201,17 @@ static void print_dirs(void)
         printf("    %s, %s\n", pattern.c_str(), path.c_str());
     }
 
+    size = cache_policies.size();
+    printf("cache_policies: %zu\n", size);
+    for (unsigned int i = 0; i < size; i++) {
+        const cache_policy_t &policy = cache_policies[i];
+        printf("    %s, entry=%g attr=%g%s%s prealloc=%jd\n", policy.pattern.c_str(),
+               policy.entry_timeout, policy.attr_timeout,
+               policy.keep_cache ? " keep_cache" : "",
+               policy.direct_io ? " direct_io" : "",
+               (intmax_t)policy.prealloc);
+    }
+
     size = target_dirs.size();
     printf("target_dirs: %zu\n", size);
     for (unsigned int i = 0; i < size; i++) {
@@ -1184,6 +6225,43 @@ static void print_dirs(void)
 }
 
 
+/* caller holds mutex; line is what follows the "cache" keyword */
+static void read_cache_policy(char *line)
+{
+    char *saveptr = NULL;
+    char *token = strtok_r(line, " \t\n", &saveptr);
+
+    if(token == NULL){
+        PRINT_ERR("Error: cache line without a pattern");
+        return;
+    }
+
+    cache_policy_t policy = {token, 0, 0, 0, 0, 0};
+    while((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL){
+        if(sscanf(token, "entry=%lf", &policy.entry_timeout) == 1){
+            continue;
+        }else if(sscanf(token, "attr=%lf", &policy.attr_timeout) == 1){
+            continue;
+        }else if(strcmp(token, "keep_cache") == 0){
+            policy.keep_cache = 1;
+        }else if(strcmp(token, "direct_io") == 0){
+            policy.direct_io = 1;
+        }else if(strncmp(token, "prealloc=", 9) == 0){
+            char *end;
+            policy.prealloc = strtoll(token + 9, &end, 10);
+            switch(toupper((unsigned char)*end)){
+            case 'G': policy.prealloc *= 1024;  /* fall through */
+            case 'M': policy.prealloc *= 1024;  /* fall through */
+            case 'K': policy.prealloc *= 1024;
+            }
+        }else{
+            PRINT_ERR("Error: unknown cache option %s for %s", token, policy.pattern.c_str());
+        }
+    }
+    cache_policies.push_back(policy);
+}
+
+
 static void read_config(void)
 {
     FILE *configfp;
@@ -1197,6 +6275,7 @@ static void read_config(void)
 
     target_patterns.clear();
     target_dirs.clear();
+    cache_policies.clear();
 
     configfp = fopen(configfile, "r");
     if(configfp == NULL){
@@ -1209,6 +6288,10 @@ static void read_config(void)
             continue;
         }
         PRINT("%s", buf);
+        if(strncmp(buf, "cache", 5) == 0 && isspace((unsigned char)buf[5])){
+            read_cache_policy(buf + 5);
+            continue;
+        }
         sscanf(buf, "%s%s", pattern, path);
 
         struct statvfs statvfs_buf = {0};
@@ -1224,6 +6307,9 @@ static void read_config(void)
             
             if(check_same_dir(path) == 0){
                 dir_t dir_buf = {(string)path, fs_size};
+                dir_buf.vfs = statvfs_buf;
+                nas_id(path);
+                root_open(path);
                 target_dirs.push_back(dir_buf);
             } 
         }  
@@ -1266,11 +6352,38 @@ static int gdtnfs_opt_proc(void *data, const char *arg, int key, struct fuse_arg
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int ret;
 
     gdtnfs_conf.print_info = 0;
+    gdtnfs_conf.wbuf_size = 128 * 1024;
+    gdtnfs_conf.wbuf_delay = 1000;
+    gdtnfs_conf.fsync_window = 0;
+    gdtnfs_conf.ra_max = 4 * 1024 * 1024;
+    gdtnfs_conf.ra_pool = 64 * 1024 * 1024;
+    gdtnfs_conf.day_prefetch = 1;
+    gdtnfs_conf.dcache_max = 256 * 1024;
+    gdtnfs_conf.attr_ttl = 1000;
+    gdtnfs_conf.skel_days = 1;
+    gdtnfs_conf.fd_max = 0;
+    gdtnfs_conf.move_threads = 4;
     if(fuse_opt_parse(&args, &gdtnfs_conf, gdtnfs_opts, gdtnfs_opt_proc) == -1){
         exit(EXIT_FAILURE);
     }
+    if(fuse_parse_cmdline(&args, &opts) != 0){
+        exit(EXIT_FAILURE);
+    }
+    if(opts.show_help){
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        exit(EXIT_SUCCESS);
+    }
+    if(opts.show_version){
+        fuse_lowlevel_version();
+        exit(EXIT_SUCCESS);
+    }
 
     if (!gdtnfs_conf.mountpoint) {
         fprintf(stderr, "Error: no mountpoint specified\n");
@@ -1299,9 +6412,70 @@ int main(int argc, char *argv[])
     }
 
     PRINT_ERR("configfile: %s", configfile);
+    if (gdtnfs_conf.spillfile) {
+        spillfile = gdtnfs_conf.spillfile;
+    }else {
+        spillfile = string(configfile) + ".spill";
+    }
+    read_spill();
+    if (gdtnfs_conf.inofile) {
+        inofile = gdtnfs_conf.inofile;
+    }else {
+        inofile = string(configfile) + ".ino";
+    }
+    read_inofile();
     read_config();
     print_dirs();
 
     default_umask =  umask(0);
-    return fuse_main(args.argc, args.argv, &gdtnfs_oper, NULL);
+    inode_init();
+
+    /* leave half of the fd limit to directories and the FUSE channel */
+    if(gdtnfs_conf.fd_max == 0){
+        struct rlimit rl;
+        if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY){
+            gdtnfs_conf.fd_max = rl.rlim_cur / 2;
+        }else{
+            gdtnfs_conf.fd_max = 512;
+        }
+    }
+    PRINT_INFO("fd_max: %u", gdtnfs_conf.fd_max);
+
+    /* the kernel only takes max_read from the mount options; it has to
+     * match conn->max_read set in gdtnfs_init */
+    if(gdtnfs_conf.writeback){
+        char max_read[64];
+        snprintf(max_read, sizeof(max_read), "-omax_read=%d", WRITEBACK_MAX_WRITE);
+        fuse_opt_add_arg(&args, max_read);
+    }
+
+    se = fuse_session_new(&args, &gdtnfs_ll_oper, sizeof(gdtnfs_ll_oper), NULL);
+    if(se == NULL){
+        exit(EXIT_FAILURE);
+    }
+    if(fuse_set_signal_handlers(se) != 0){
+        fuse_session_destroy(se);
+        exit(EXIT_FAILURE);
+    }
+    if(fuse_session_mount(se, opts.mountpoint) != 0){
+        fuse_remove_signal_handlers(se);
+        fuse_session_destroy(se);
+        exit(EXIT_FAILURE);
+    }
+
+    fuse_daemonize(opts.foreground || gdtnfs_conf.foreground);
+    single_thread = opts.singlethread;
+    if(opts.singlethread){
+        ret = fuse_session_loop(se);
+    }else{
+        ret = fuse_session_loop_mt(se, opts.clone_fd);
+    }
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+    fuse_session_destroy(se);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -8,8 +8,11 @@ mountpoint -q ${MNT_DIR} && ./umount.sh
 ####./gdtnfs -s -d -o auto_unmount,allow_other,logfile=${LOG_FILE},configfile=${CONFIG_FILE} ${MNT_DIR}
 #./gdtnfs -s -f -o auto_unmount,allow_other,logfile=${LOG_FILE},configfile=${CONFIG_FILE} ${MNT_DIR}
 
-## multi thread
+## multi thread (needed to rename directories across NAS inside SDFS)
 #./gdtnfs -o auto_unmount,allow_other,logfile=${LOG_FILE},configfile=${CONFIG_FILE} ${MNT_DIR}
 
+## multi thread, fsync calls on the same NAS batched within 2ms
+#./diy-sdfs -o auto_unmount,allow_other,fsync_window=2000,logfile=${LOG_FILE},configfile=${CONFIG_FILE} ${MNT_DIR}
+
 ## single thread, print_info
 #./gdtnfs -s -f -o auto_unmount,print_info,allow_other,logfile=${LOG_FILE},configfile=${CONFIG_FILE} ${MNT_DIR}
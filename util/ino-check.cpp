@@ -0,0 +1,130 @@
+/*
+ * Check of the SDFS inode numbering (compose_ino, nas_id, read_inofile).
+ *
+ * Build and run from the top directory:
+ *   ./compile.sh util/ino-check && ./util/ino-check
+ *
+ * It pulls in diy-sdfs.cpp as is, so it checks the daemon's own code
+ * rather than a copy of it. Exits non-zero on the first failure.
+ */
+#define main gdtnfs_main
+#include "../diy-sdfs.cpp"
+#undef main
+
+static int failed;
+
+#define CHECK(cond) do { \
+    if(!(cond)){ \
+        fprintf(stderr, "ino-check l.%03d: %s\n", __LINE__, #cond); \
+        failed = 1; \
+    } \
+} while(0)
+
+
+/* forget everything in memory, as a restart of the daemon would */
+static void ino_reset(void)
+{
+    if(inofp != NULL){
+        fclose(inofp);
+        inofp = NULL;
+    }
+    nas_ids.clear();
+    ino_table.clear();
+    ino_table_next = 1;
+    nas_id_next = 1;
+}
+
+
+int main(void)
+{
+    char tmpl[] = "/tmp/ino-check.XXXXXX";
+    int fd = mkstemp(tmpl);
+    if(fd == -1){
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    inofile = tmpl;
+    read_inofile();
+    CHECK(inofp != NULL);
+
+    const char *nas[] = {"/nas1/", "/nas2/", "/nas3/"};
+    const ino_t big[] = {(ino_t)1 << 50, ((ino_t)1 << 50) + 1};
+    uint64_t id[3];
+    ino_t low[3][3];
+    ino_t table[3][2];
+
+    /* the same low backend inodes on every NAS stay apart */
+    for(int i = 0; i < 3; i++){
+        id[i] = nas_id(nas[i]);
+        CHECK(id[i] != 0 && id[i] < INO_TABLE_ID);
+        CHECK(nas_id(nas[i]) == id[i]);
+        for(int j = 0; j < 3; j++){
+            low[i][j] = compose_ino(id[i], 2 + j);
+            CHECK((low[i][j] & INO_LOCAL_MASK) == (ino_t)(2 + j));
+            CHECK((low[i][j] >> INO_NAS_SHIFT) == id[i]);
+        }
+    }
+    CHECK(id[0] != id[1] && id[1] != id[2] && id[0] != id[2]);
+    for(int i = 0; i < 3; i++){
+        for(int k = 0; k < i; k++){
+            for(int j = 0; j < 3; j++){
+                CHECK(low[i][j] != low[k][j]);
+            }
+        }
+    }
+
+    /* inodes above the 48 bits go through the table, once per NAS and inode */
+    unordered_set<ino_t> seen;
+    for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 2; j++){
+            table[i][j] = compose_ino(id[i], big[j]);
+            CHECK((table[i][j] >> INO_NAS_SHIFT) == INO_TABLE_ID);
+            CHECK(compose_ino(id[i], big[j]) == table[i][j]);
+            CHECK(seen.insert(table[i][j]).second);
+        }
+    }
+
+    /* a restart reads the same numbers back */
+    ino_reset();
+    read_inofile();
+    for(int i = 0; i < 3; i++){
+        CHECK(nas_id(nas[i]) == id[i]);
+        for(int j = 0; j < 3; j++){
+            CHECK(compose_ino(id[i], 2 + j) == low[i][j]);
+        }
+        for(int j = 0; j < 2; j++){
+            CHECK(compose_ino(id[i], big[j]) == table[i][j]);
+        }
+    }
+
+    /* and hands out fresh ones past them */
+    uint64_t id4 = nas_id("/nas4/");
+    CHECK(id4 != id[0] && id4 != id[1] && id4 != id[2]);
+    ino_t next = compose_ino(id[0], ((ino_t)1 << 50) + 2);
+    CHECK(seen.insert(next).second);
+
+    /* a hand-edited line reusing an id or table number is skipped */
+    ino_reset();
+    FILE *fp = fopen(tmpl, "a");
+    CHECK(fp != NULL);
+    if(fp != NULL){
+        fprintf(fp, "nas %" PRIu64 " /nas5/\n", id[0]);
+        fprintf(fp, "ino %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                id[1], (uint64_t)big[0] + 7, (uint64_t)table[0][0]);
+        fclose(fp);
+    }
+    read_inofile();
+    CHECK(nas_id("/nas1/") == id[0]);
+    CHECK(nas_id("/nas5/") != id[0]);
+    CHECK(compose_ino(id[0], big[0]) == table[0][0]);
+    CHECK(compose_ino(id[1], big[0] + 7) != table[0][0]);
+
+    ino_reset();
+    unlink(tmpl);
+
+    if(!failed){
+        printf("ino-check: ok\n");
+    }
+    return failed;
+}